@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+
+/* Scheduling microbenchmarks, one CSV or JSON line per result:
+ *
+ *   switch   one-way handoff between two threads blocking on semaphores
+ *   yield    yield round trip between two threads
+ *   create   worker_create + worker_join of a batch of empty threads
+ *   mutex    lock/unlock of one mutex by 1..N contenders
+ *
+ * Each result is the distribution, over many samples, of the ns one
+ * operation took in a timed batch. The Makefile builds it against the
+ * runtime under each policy (bench_rr, bench_mlfq, bench_cfs) and against
+ * plain pthreads (bench_pthread) for a baseline. Both run on -c CPUs: that
+ * many carriers, or the pthreads pinned to that many CPUs. */
+
+#ifdef USE_PTHREAD
+#include <pthread.h>
+#include <semaphore.h>
+#define POLICY "pthread"
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef sem_t semaphore_t;
+#define thread_create(t, f, arg) pthread_create(t, NULL, f, arg)
+#define thread_join(t) pthread_join(t, NULL)
+#define thread_yield() sched_yield()
+#define mutex_init(m) pthread_mutex_init(m, NULL)
+#define mutex_lock(m) pthread_mutex_lock(m)
+#define mutex_unlock(m) pthread_mutex_unlock(m)
+#define mutex_destroy(m) pthread_mutex_destroy(m)
+#define semaphore_init(s, v) sem_init(s, 0, v)
+#define semaphore_wait(s) sem_wait(s)
+#define semaphore_post(s) sem_post(s)
+#else
+#include "../thread-worker.h"
+#if defined(MLFQ)
+#define POLICY "MLFQ"
+#elif defined(CFS)
+#define POLICY "CFS"
+#else
+#define POLICY "RR"
+#endif
+typedef worker_t thread_t;
+typedef worker_mutex_t mutex_t;
+typedef worker_sem_t semaphore_t;
+#define thread_create(t, f, arg) worker_create(t, NULL, f, arg)
+#define thread_join(t) worker_join(t, NULL)
+#define thread_yield() worker_yield()
+#define mutex_init(m) worker_mutex_init(m, NULL)
+#define mutex_lock(m) worker_mutex_lock(m)
+#define mutex_unlock(m) worker_mutex_unlock(m)
+#define mutex_destroy(m) worker_mutex_destroy(m)
+#define semaphore_init(s, v) worker_sem_init(s, v)
+#define semaphore_wait(s) worker_sem_wait(s)
+#define semaphore_post(s) worker_sem_post(s)
+#endif
+
+#define DEFAULT_SAMPLES 200
+#define DEFAULT_CONTENDERS 8
+#define SWITCH_BATCH 1000 // round trips per switch or yield sample
+#define CREATE_BATCH 100  // threads per create sample
+#define MUTEX_OPS 2000    // lock/unlock pairs per contender per mutex sample
+#define MAX_CONTENDERS 64
+
+int samples = DEFAULT_SAMPLES;
+int json = 0;
+
+volatile int stop;
+semaphore_t ping, pong;
+mutex_t mutex;
+volatile long counter;
+
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int compare(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* nearest-rank percentile of n sorted values */
+double percentile(double *sorted, int n, double p)
+{
+	int rank = (int)(p / 100 * n + 0.999999);
+	return sorted[rank < 1 ? 0 : rank > n ? n - 1 : rank - 1];
+}
+
+/* print one result: ns per operation over the samples */
+void report(const char *bench, int threads, double *ns, int n)
+{
+	double mean = 0;
+	int i;
+
+	qsort(ns, n, sizeof(double), compare);
+	for (i = 0; i < n; i++)
+		mean += ns[i];
+	mean /= n;
+
+	if (json)
+		printf("{\"bench\":\"%s\",\"policy\":\"%s\",\"threads\":%d,\"samples\":%d,"
+			   "\"mean_ns\":%.1f,\"p50_ns\":%.1f,\"p90_ns\":%.1f,\"p99_ns\":%.1f,"
+			   "\"max_ns\":%.1f,\"ops_per_s\":%.0f}\n",
+			   bench, POLICY, threads, n, mean, percentile(ns, n, 50), percentile(ns, n, 90),
+			   percentile(ns, n, 99), ns[n - 1], 1e9 / mean);
+	else
+		printf("%s,%s,%d,%d,%.1f,%.1f,%.1f,%.1f,%.1f,%.0f\n",
+			   bench, POLICY, threads, n, mean, percentile(ns, n, 50), percentile(ns, n, 90),
+			   percentile(ns, n, 99), ns[n - 1], 1e9 / mean);
+	fflush(stdout);
+}
+
+void *switch_partner(void *arg)
+{
+	for (;;)
+	{
+		semaphore_wait(&ping);
+		if (stop)
+			return NULL;
+		semaphore_post(&pong);
+	}
+}
+
+/* two threads pass a token back and forth, each blocking until it comes back */
+void bench_switch(double *ns)
+{
+	thread_t partner;
+	double start;
+	int s, i;
+
+	stop = 0;
+	semaphore_init(&ping, 0);
+	semaphore_init(&pong, 0);
+	thread_create(&partner, &switch_partner, NULL);
+
+	for (s = -1; s < samples; s++)
+	{
+		start = now();
+		for (i = 0; i < SWITCH_BATCH; i++)
+		{
+			semaphore_post(&ping);
+			semaphore_wait(&pong);
+		}
+		// a round trip is two switches; the first batch only warms up
+		if (s >= 0)
+			ns[s] = (now() - start) / (2 * SWITCH_BATCH);
+	}
+
+	stop = 1;
+	semaphore_post(&ping);
+	thread_join(partner);
+	report("switch", 2, ns, samples);
+}
+
+void *yield_partner(void *arg)
+{
+	while (!stop)
+		thread_yield();
+	return NULL;
+}
+
+/* two threads yield to each other, the other one is always runnable */
+void bench_yield(double *ns)
+{
+	thread_t partner;
+	double start;
+	int s, i;
+
+	stop = 0;
+	thread_create(&partner, &yield_partner, NULL);
+
+	for (s = -1; s < samples; s++)
+	{
+		start = now();
+		for (i = 0; i < SWITCH_BATCH; i++)
+			thread_yield();
+		if (s >= 0)
+			ns[s] = (now() - start) / SWITCH_BATCH;
+	}
+
+	stop = 1;
+	thread_join(partner);
+	report("yield", 2, ns, samples);
+}
+
+void *empty(void *arg)
+{
+	return NULL;
+}
+
+/* create a batch of threads that do nothing, then join them all */
+void bench_create(double *ns)
+{
+	thread_t thread[CREATE_BATCH];
+	double start;
+	int s, i;
+
+	for (s = -1; s < samples; s++)
+	{
+		start = now();
+		for (i = 0; i < CREATE_BATCH; i++)
+			thread_create(&thread[i], &empty, NULL);
+		for (i = 0; i < CREATE_BATCH; i++)
+			thread_join(thread[i]);
+		if (s >= 0)
+			ns[s] = (now() - start) / CREATE_BATCH;
+	}
+	report("create", 1, ns, samples);
+}
+
+void *contend(void *arg)
+{
+	int i;
+
+	for (i = 0; i < MUTEX_OPS; i++)
+	{
+		mutex_lock(&mutex);
+		counter++;
+		mutex_unlock(&mutex);
+	}
+	return NULL;
+}
+
+/* threads contenders at a time hammer one mutex */
+void bench_mutex(double *ns, int contenders)
+{
+	thread_t thread[MAX_CONTENDERS];
+	double start;
+	int s, i;
+
+	mutex_init(&mutex);
+	for (s = -1; s < samples; s++)
+	{
+		counter = 0;
+		start = now();
+		for (i = 0; i < contenders; i++)
+			thread_create(&thread[i], &contend, NULL);
+		for (i = 0; i < contenders; i++)
+			thread_join(thread[i]);
+		if (s >= 0)
+			ns[s] = (now() - start) / ((double)contenders * MUTEX_OPS);
+		if (counter != (long)contenders * MUTEX_OPS)
+		{
+			fprintf(stderr, "mutex: lost updates, %ld of %d\n", counter, contenders * MUTEX_OPS);
+			exit(1);
+		}
+	}
+	mutex_destroy(&mutex);
+	report("mutex", contenders, ns, samples);
+}
+
+void usage()
+{
+	printf("usage: bench [-f csv|json] [-s samples] [-n max contenders] [-c cpus] [-H] [benchmark...]\n"
+		   "benchmarks: switch yield create mutex (default: all)\n"
+		   "-f json prints one object per line, -H leaves out the CSV header\n");
+	exit(1);
+}
+
+int wanted(const char *bench, char **names, int count)
+{
+	int i;
+
+	if (count == 0)
+		return 1;
+	for (i = 0; i < count; i++)
+		if (strcmp(names[i], bench) == 0)
+			return 1;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int contenders = DEFAULT_CONTENDERS, cpus = 1, header = 1;
+	char **names;
+	int opt, count, k;
+	double *ns;
+
+	while ((opt = getopt(argc, argv, "f:s:n:c:H")) != -1)
+	{
+		switch (opt)
+		{
+		case 'f':
+			if (strcmp(optarg, "json") != 0 && strcmp(optarg, "csv") != 0)
+				usage();
+			json = strcmp(optarg, "json") == 0;
+			break;
+		case 's':
+			samples = atoi(optarg);
+			break;
+		case 'n':
+			contenders = atoi(optarg);
+			break;
+		case 'c':
+			cpus = atoi(optarg);
+			break;
+		case 'H':
+			header = 0;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (samples < 1 || contenders < 1 || contenders > MAX_CONTENDERS || cpus < 1)
+		usage();
+	names = argv + optind;
+	count = argc - optind;
+
+#ifdef USE_PTHREAD
+	// the same CPUs the runtime gets carriers
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (k = 0; k < cpus && k < CPU_SETSIZE; k++)
+		CPU_SET(k, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+#else
+	char buf[16];
+	snprintf(buf, sizeof(buf), "%d", cpus);
+	setenv("WORKER_CARRIERS", buf, 1);
+#endif
+
+	if (header && !json)
+		printf("bench,policy,threads,samples,mean_ns,p50_ns,p90_ns,p99_ns,max_ns,ops_per_s\n");
+
+	ns = (double *)malloc(samples * sizeof(double));
+	if (wanted("switch", names, count))
+		bench_switch(ns);
+	if (wanted("yield", names, count))
+		bench_yield(ns);
+	if (wanted("create", names, count))
+		bench_create(ns);
+	if (wanted("mutex", names, count))
+	{
+		for (k = 1; k < contenders; k *= 2)
+			bench_mutex(ns, k);
+		bench_mutex(ns, contenders);
+	}
+
+	free(ns);
+	return 0;
+}
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../thread-worker.h"
+
+#define DEFAULT_BLOCKERS 4
+#define DEFAULT_TICKS 500
+#define TICK_NS 1000000LL // the ticker wants to run every ms
+#define BLOCK_US 5000     // each blocking call holds its kernel thread this long
+
+/* A ticker worker sleeps a ms at a time and records how late it wakes
+ * up, while other workers keep making system calls that block their
+ * kernel thread (usleep from libc here, standing in for fsync or a disk
+ * read). With "raw" they just block, and everything on their carrier
+ * waits with them; by default they bracket the call with
+ * worker_blocking_begin/end and move to a spare kernel thread instead.
+ * Runs on one carrier unless WORKER_CARRIERS says otherwise. */
+
+volatile int stop = 0;
+int handoff = 1;
+long long *late;
+
+long long now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int compare(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return x < y ? -1 : x > y;
+}
+
+void *blocker(void *arg)
+{
+	long calls = 0;
+
+	while (!stop)
+	{
+		if (handoff)
+			worker_blocking_begin();
+		usleep(BLOCK_US);
+		if (handoff)
+			worker_blocking_end();
+		calls++;
+		// a blocked kernel thread uses no CPU time, so the timer never
+		// preempts us: raw, nothing else would ever run
+		worker_yield();
+	}
+	return (void *)calls;
+}
+
+void *ticker(void *arg)
+{
+	int ticks = *(int *)arg, i;
+	long long due = now();
+
+	for (i = 0; i < ticks; i++)
+	{
+		due += TICK_NS;
+		worker_sleep_ns(due - now() > 0 ? due - now() : 0);
+		late[i] = now() - due;
+		if (late[i] > 0)
+			due += late[i]; // don't try to catch up
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	worker_t tick_thread, *thread;
+	int blockers, ticks, i;
+	long calls = 0;
+	void *ret;
+
+	blockers = argc > 1 ? atoi(argv[1]) : DEFAULT_BLOCKERS;
+	ticks = argc > 2 ? atoi(argv[2]) : DEFAULT_TICKS;
+	handoff = !(argc > 3 && strcmp(argv[3], "raw") == 0);
+	if (blockers < 0 || ticks < 1)
+	{
+		printf("usage: blocking_calls [blockers] [ticks] [raw]\n");
+		return 0;
+	}
+	setenv("WORKER_CARRIERS", "1", 0);
+
+	thread = (worker_t *)malloc((blockers + 1) * sizeof(worker_t));
+	late = (long long *)malloc(ticks * sizeof(long long));
+
+	worker_create(&tick_thread, NULL, &ticker, &ticks);
+	for (i = 0; i < blockers; i++)
+		worker_create(&thread[i], NULL, &blocker, NULL);
+	worker_join(tick_thread, NULL);
+	stop = 1;
+	for (i = 0; i < blockers; i++)
+	{
+		worker_join(thread[i], &ret);
+		calls += (long)ret;
+	}
+
+	qsort(late, ticks, sizeof(long long), compare);
+	printf("%s, %d blockers made %ld calls: ticker late p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+		   handoff ? "handoff" : "raw", blockers, calls, late[ticks / 2] / 1e6,
+		   late[ticks * 99 / 100] / 1e6, late[ticks - 1] / 1e6);
+
+	free(late);
+	free(thread);
+	return 0;
+}
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../thread-worker.h"
+
+#define DEFAULT_PAIRS 50
+#define DEFAULT_ITEMS 20000
+#define SLOTS 64
+
+/* Producers and consumers pass numbers through a small ring guarded by a
+ * mutex and two condition variables. A barrier lines everyone up before
+ * the clock starts, so the run measures handoffs between parked
+ * workers, not thread creation. */
+
+worker_mutex_t mutex;
+worker_cond_t not_empty, not_full;
+worker_barrier_t start_line;
+int ring[SLOTS];
+int head, tail, used;
+int items;
+long long total;
+
+void *producer(void *arg)
+{
+	int i;
+
+	worker_barrier_wait(&start_line);
+	for (i = 1; i <= items; i++)
+	{
+		worker_mutex_lock(&mutex);
+		while (used == SLOTS)
+			worker_cond_wait(&not_full, &mutex);
+		ring[tail] = i;
+		tail = (tail + 1) % SLOTS;
+		used++;
+		worker_cond_signal(&not_empty);
+		worker_mutex_unlock(&mutex);
+	}
+	return NULL;
+}
+
+void *consumer(void *arg)
+{
+	long long sum = 0;
+	int i;
+
+	worker_barrier_wait(&start_line);
+	for (i = 0; i < items; i++)
+	{
+		worker_mutex_lock(&mutex);
+		while (used == 0)
+			worker_cond_wait(&not_empty, &mutex);
+		sum += ring[head];
+		head = (head + 1) % SLOTS;
+		used--;
+		worker_cond_signal(&not_full);
+		worker_mutex_unlock(&mutex);
+	}
+
+	worker_mutex_lock(&mutex);
+	total += sum;
+	worker_mutex_unlock(&mutex);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct timespec start, end;
+	int pairs, i;
+	worker_t *thread;
+	double secs;
+
+	pairs = argc > 1 ? atoi(argv[1]) : DEFAULT_PAIRS;
+	items = argc > 2 ? atoi(argv[2]) : DEFAULT_ITEMS;
+	if (pairs < 1 || items < 1)
+	{
+		printf("usage: bounded_buffer [pairs] [items per producer]\n");
+		return 0;
+	}
+
+	thread = (worker_t *)malloc(2 * pairs * sizeof(worker_t));
+	worker_mutex_init(&mutex, NULL);
+	worker_cond_init(&not_empty, NULL);
+	worker_cond_init(&not_full, NULL);
+	// main is the serial thread that starts the clock
+	worker_barrier_init(&start_line, 2 * pairs + 1);
+
+	for (i = 0; i < pairs; i++)
+	{
+		worker_create(&thread[2 * i], NULL, &producer, NULL);
+		worker_create(&thread[2 * i + 1], NULL, &consumer, NULL);
+	}
+
+	worker_barrier_wait(&start_line);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < 2 * pairs; i++)
+		worker_join(thread[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%d producer/consumer pairs moved %lld items in %.3f s: %.0f items/s\n",
+		   pairs, (long long)pairs * items, secs, pairs * items / secs);
+	if (total != (long long)pairs * items * (items + 1) / 2)
+		printf("checksum mismatch: %lld\n", total);
+
+	worker_barrier_destroy(&start_line);
+	worker_cond_destroy(&not_empty);
+	worker_cond_destroy(&not_full);
+	worker_mutex_destroy(&mutex);
+	free(thread);
+	return 0;
+}
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#define DEFAULT_THREADS 200000
+#define DEFAULT_WAVE 1000
+
+/* A plain pthread program that spends its time making short-lived threads:
+ * waves of them each take a lock, bump a counter and, the last of a wave,
+ * wake main with a condition variable. It is not linked against the
+ * runtime. make shim-compare runs it as is and again under
+ * LD_PRELOAD=../libworker-pthread.so to see what green threads buy. */
+
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t wave_done = PTHREAD_COND_INITIALIZER;
+int finished, wave;
+long total;
+
+void *task(void *arg)
+{
+	pthread_mutex_lock(&mutex);
+	total += (long)arg;
+	if (++finished == wave)
+		pthread_cond_signal(&wave_done);
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct timespec start, end;
+	int thread_num, made, i;
+	pthread_t *thread;
+	double secs;
+
+	thread_num = argc > 1 ? atoi(argv[1]) : DEFAULT_THREADS;
+	wave = argc > 2 ? atoi(argv[2]) : DEFAULT_WAVE;
+	if (thread_num < 1 || wave < 1)
+	{
+		printf("usage: create_storm [threads] [threads per wave]\n");
+		return 0;
+	}
+
+	thread = (pthread_t *)malloc(wave * sizeof(pthread_t));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (made = 0; made < thread_num; made += wave)
+	{
+		if (wave > thread_num - made)
+			wave = thread_num - made;
+		finished = 0;
+		for (i = 0; i < wave; i++)
+		{
+			if (pthread_create(&thread[i], NULL, &task, (void *)(long)(made + i)) != 0)
+			{
+				perror("pthread_create");
+				exit(1);
+			}
+		}
+		pthread_mutex_lock(&mutex);
+		while (finished < wave)
+			pthread_cond_wait(&wave_done, &mutex);
+		pthread_mutex_unlock(&mutex);
+		for (i = 0; i < wave; i++)
+			pthread_join(thread[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%d threads in %.3f s: %.0f threads/s\n", thread_num, secs, thread_num / secs);
+	if (total != (long)thread_num * (thread_num - 1) / 2)
+		printf("checksum mismatch: %ld\n", total);
+
+	free(thread);
+	return 0;
+}
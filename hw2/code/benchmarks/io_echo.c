@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "../thread-worker.h"
+
+#define DEFAULT_CONNECTIONS 1000
+#define DEFAULT_ROUNDS 100
+#define MESSAGE 64
+
+/* Every connection is a socketpair with a client worker on one end and
+ * an echo worker on the other. Clients send a message and wait for it to
+ * come back, so most workers are parked on their socket at any time. */
+
+int rounds;
+
+void *echo(void *arg)
+{
+	int fd = *(int *)arg;
+	char buf[MESSAGE];
+	ssize_t n;
+
+	while ((n = worker_read(fd, buf, sizeof(buf))) > 0)
+	{
+		worker_write(fd, buf, n);
+	}
+	return NULL;
+}
+
+void *client(void *arg)
+{
+	int fd = *(int *)arg;
+	char buf[MESSAGE];
+	int i;
+	ssize_t n, got;
+
+	memset(buf, 'x', sizeof(buf));
+	for (i = 0; i < rounds; i++)
+	{
+		worker_write(fd, buf, sizeof(buf));
+		for (got = 0; got < MESSAGE; got += n)
+		{
+			if ((n = worker_read(fd, buf + got, MESSAGE - got)) <= 0)
+			{
+				printf("connection lost\n");
+				exit(1);
+			}
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct timespec start, end;
+	int connections, i;
+	int (*fds)[2];
+	worker_t *thread;
+	double s;
+
+	connections = argc > 1 ? atoi(argv[1]) : DEFAULT_CONNECTIONS;
+	rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_ROUNDS;
+	if (connections < 1 || rounds < 1)
+	{
+		printf("usage: io_echo [connections] [rounds]\n");
+		return 0;
+	}
+
+	fds = malloc(connections * sizeof(*fds));
+	thread = malloc(2 * connections * sizeof(worker_t));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < connections; i++)
+	{
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]) < 0)
+		{
+			perror("socketpair");
+			exit(1);
+		}
+		worker_create(&thread[2 * i], NULL, &echo, &fds[i][0]);
+		worker_create(&thread[2 * i + 1], NULL, &client, &fds[i][1]);
+	}
+
+	for (i = 0; i < connections; i++)
+	{
+		// hanging up the client end lets its echo worker see EOF
+		worker_join(thread[2 * i + 1], NULL);
+		close(fds[i][1]);
+		worker_join(thread[2 * i], NULL);
+		close(fds[i][0]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	s = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%d connections, %d round trips each: %.0f round trips/s\n",
+		   connections, rounds, connections * (double)rounds / s);
+
+	free(fds);
+	free(thread);
+	return 0;
+}
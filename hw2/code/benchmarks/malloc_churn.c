@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../thread-worker.h"
+
+#define DEFAULT_THREAD_NUM 64
+#define DEFAULT_OPS 200000
+#define LIVE 64       // blocks each worker keeps around
+#define MAX_SIZE 512  // blocks are 1 to MAX_SIZE bytes
+
+/* Workers allocate and free small blocks of random sizes, keeping a few
+ * dozen alive, and hand every fourth one to a neighbour to free, so some
+ * frees land on another carrier than the allocation. Runs on
+ * worker_malloc, or with "malloc" on glibc malloc: that one could
+ * deadlock if the timer switched a worker out inside it, so it runs
+ * with preemption off. */
+
+typedef struct Mailbox
+{
+	worker_mutex_t mutex;
+	void *blocks[LIVE];
+	int count;
+} mailbox_t;
+
+int use_malloc = 0;
+int thread_num, ops;
+mailbox_t *mailbox;
+
+void *alloc(size_t size)
+{
+	return use_malloc ? malloc(size) : worker_malloc(size);
+}
+
+void release(void *p)
+{
+	if (use_malloc)
+		free(p);
+	else
+		worker_free(p);
+}
+
+/* free what the neighbour handed us */
+void empty(mailbox_t *box)
+{
+	void *blocks[LIVE];
+	int n, i;
+
+	worker_mutex_lock(&box->mutex);
+	n = box->count;
+	memcpy(blocks, box->blocks, n * sizeof(void *));
+	box->count = 0;
+	worker_mutex_unlock(&box->mutex);
+	for (i = 0; i < n; i++)
+		release(blocks[i]);
+}
+
+void *churn(void *arg)
+{
+	long id = (long)arg;
+	mailbox_t *next = &mailbox[(id + 1) % thread_num];
+	unsigned int seed = id + 1;
+	void *live[LIVE] = {NULL};
+	int i, k, passed;
+
+	for (i = 0; i < ops; i++)
+	{
+		k = rand_r(&seed) % LIVE;
+		if (live[k] == NULL)
+		{
+			live[k] = alloc(1 + rand_r(&seed) % MAX_SIZE);
+			*(long *)live[k] = id;
+			continue;
+		}
+		passed = 0;
+		if (i % 4 == 0)
+		{
+			worker_mutex_lock(&next->mutex);
+			if (next->count < LIVE)
+			{
+				next->blocks[next->count++] = live[k];
+				passed = 1;
+			}
+			worker_mutex_unlock(&next->mutex);
+		}
+		if (!passed)
+			release(live[k]);
+		live[k] = NULL;
+		if (i % 64 == 0)
+			empty(&mailbox[id]);
+	}
+	for (k = 0; k < LIVE; k++)
+		if (live[k] != NULL)
+			release(live[k]);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct timespec start, end;
+	worker_t *thread;
+	double secs;
+	long i;
+
+	thread_num = argc > 1 ? atoi(argv[1]) : DEFAULT_THREAD_NUM;
+	ops = argc > 2 ? atoi(argv[2]) : DEFAULT_OPS;
+	use_malloc = argc > 3 && strcmp(argv[3], "malloc") == 0;
+	if (thread_num < 1 || ops < 1)
+	{
+		printf("usage: malloc_churn [threads] [ops per thread] [malloc]\n");
+		return 0;
+	}
+	if (use_malloc)
+		setenv("WORKER_PREEMPT", "0", 1);
+
+	thread = (worker_t *)malloc(thread_num * sizeof(worker_t));
+	mailbox = (mailbox_t *)calloc(thread_num, sizeof(mailbox_t));
+	for (i = 0; i < thread_num; i++)
+		worker_mutex_init(&mailbox[i].mutex, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < thread_num; i++)
+		worker_create(&thread[i], NULL, &churn, (void *)i);
+	for (i = 0; i < thread_num; i++)
+		worker_join(thread[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	for (i = 0; i < thread_num; i++)
+		empty(&mailbox[i]);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%s: %d workers, %d ops each in %.3f s: %.1f ns per op\n",
+		   use_malloc ? "malloc" : "worker_malloc", thread_num, ops, secs,
+		   secs * 1e9 / ((double)thread_num * ops));
+
+	for (i = 0; i < thread_num; i++)
+		worker_mutex_destroy(&mailbox[i].mutex);
+	free(mailbox);
+	free(thread);
+	return 0;
+}
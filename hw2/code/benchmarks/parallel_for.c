@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../thread-worker.h"
+
+#define DEFAULT_ITEMS 100000
+#define DEFAULT_WORK 200
+#define WAVE 1024 // threads alive at once in the thread per item run
+
+/* The same small jobs three ways: a worker_create and worker_join per
+ * item, as the other benchmarks do, a task per item in a task group, and
+ * worker_parallel_for over the lot. Each job spins for work iterations
+ * and adds its result to a per-item slot, so all three can be checked. */
+
+int items, work;
+long *result;
+
+long job(long i)
+{
+	long x = i;
+	int k;
+
+	for (k = 0; k < work; k++)
+		x = x * 6364136223846793005L + 1442695040888963407L;
+	return x;
+}
+
+void *thread_item(void *arg)
+{
+	long i = (long)arg;
+	result[i] = job(i);
+	return NULL;
+}
+
+void task_item(void *arg)
+{
+	long i = (long)arg;
+	result[i] = job(i);
+}
+
+void for_items(long begin, long end, void *arg)
+{
+	long i;
+	for (i = begin; i < end; i++)
+		result[i] = job(i);
+}
+
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 1 if every slot holds its job's result, and clear them for the next run */
+int check()
+{
+	int ok = 1;
+	long i;
+
+	for (i = 0; i < items; i++)
+	{
+		if (result[i] != job(i))
+			ok = 0;
+		result[i] = 0;
+	}
+	return ok;
+}
+
+void report(const char *how, double secs)
+{
+	printf("%-22s %8.3f s %10.0f items/s %s\n", how, secs, items / secs,
+		   check() ? "" : "(wrong results)");
+}
+
+int main(int argc, char **argv)
+{
+	worker_task_group_t group;
+	worker_t thread[WAVE];
+	double start;
+	long i, j;
+
+	items = argc > 1 ? atoi(argv[1]) : DEFAULT_ITEMS;
+	work = argc > 2 ? atoi(argv[2]) : DEFAULT_WORK;
+	if (items < 1 || work < 0)
+	{
+		printf("usage: parallel_for [items] [work per item]\n");
+		return 0;
+	}
+	result = (long *)calloc(items, sizeof(long));
+
+	start = now();
+	for (i = 0; i < items; i += WAVE)
+	{
+		for (j = 0; j < WAVE && i + j < items; j++)
+			worker_create(&thread[j], NULL, &thread_item, (void *)(i + j));
+		for (j = 0; j < WAVE && i + j < items; j++)
+			worker_join(thread[j], NULL);
+	}
+	report("thread per item", now() - start);
+
+	start = now();
+	worker_task_group_init(&group);
+	for (i = 0; i < items; i++)
+		worker_task_group_run(&group, &task_item, (void *)i);
+	worker_task_group_wait(&group);
+	worker_task_group_destroy(&group);
+	report("task per item", now() - start);
+
+	start = now();
+	worker_parallel_for(0, items, 0, &for_items, NULL);
+	report("worker_parallel_for", now() - start);
+
+	free(result);
+	return 0;
+}
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../thread-worker.h"
+
+#define DEFAULT_THREAD_NUM 100000
+
+/* Park a crowd of workers on a semaphore and see what each one costs in
+ * resident memory. Stacks are only reserved, so an idle worker should be
+ * its tcb plus the page or two of stack it has touched.
+ *
+ * A million workers need WORKER_STACK_GUARD=0, or vm.max_map_count of at
+ * least two per worker: every guard page splits the stacks' mapping. */
+
+worker_sem_t go;
+int arrived;
+
+void *park(void *arg)
+{
+	__atomic_add_fetch(&arrived, 1, __ATOMIC_RELAXED);
+	worker_sem_wait(&go);
+	return NULL;
+}
+
+/* resident set size of this process in kB */
+long rss_kb()
+{
+	char line[256];
+	long kb = -1;
+	FILE *f = fopen("/proc/self/status", "r");
+
+	if (f == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), f) != NULL)
+		if (strncmp(line, "VmRSS:", 6) == 0)
+			kb = atol(line + 6);
+	fclose(f);
+	return kb;
+}
+
+int main(int argc, char **argv)
+{
+	struct timespec start, end;
+	long before, after;
+	int thread_num, i;
+	worker_t *thread;
+	double secs;
+
+	thread_num = argc > 1 ? atoi(argv[1]) : DEFAULT_THREAD_NUM;
+	if (thread_num < 1)
+	{
+		printf("usage: parked_threads [threads]\n");
+		return 0;
+	}
+
+	thread = (worker_t *)malloc(thread_num * sizeof(worker_t));
+	memset(thread, 0, thread_num * sizeof(worker_t));
+	worker_sem_init(&go, 0);
+
+	before = rss_kb();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < thread_num; i++)
+	{
+		if (worker_create(&thread[i], NULL, &park, NULL) != 0)
+		{
+			printf("worker_create failed after %d workers\n", i);
+			thread_num = i;
+			break;
+		}
+	}
+	// let every one of them run up to the semaphore
+	while (__atomic_load_n(&arrived, __ATOMIC_RELAXED) < thread_num)
+		worker_yield();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	after = rss_kb();
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%d parked workers in %.2f s: %ld kB resident, %.0f bytes each\n",
+		   thread_num, secs, after, thread_num > 0 ? (after - before) * 1024.0 / thread_num : 0);
+
+	for (i = 0; i < thread_num; i++)
+		worker_sem_post(&go);
+	for (i = 0; i < thread_num; i++)
+		worker_join(thread[i], NULL);
+
+	free(thread);
+	return 0;
+}
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../thread-worker.h"
+
+#define DEFAULT_STAGES 8
+#define DEFAULT_ITEMS 200000
+#define DEFAULT_CAPACITY 0
+
+/* A chain of stages joined by channels: the first numbers the items, each
+ * stage adds one and passes them on, and the last sums them up. Nobody
+ * polls or yields; every wait is a parked send or receive. Closing the
+ * first channel shuts the whole chain down. */
+
+worker_chan_t *chan;
+int stages, items;
+
+void *source(void *arg)
+{
+	long i;
+
+	for (i = 0; i < items; i++)
+		worker_chan_send(&chan[0], &i);
+	worker_chan_close(&chan[0]);
+	return NULL;
+}
+
+void *stage(void *arg)
+{
+	long k = (long)arg, v;
+
+	while (worker_chan_recv(&chan[k], &v) == 0)
+	{
+		v++;
+		worker_chan_send(&chan[k + 1], &v);
+	}
+	worker_chan_close(&chan[k + 1]);
+	return NULL;
+}
+
+void *sink(void *arg)
+{
+	long v, *sum = (long *)arg;
+
+	while (worker_chan_recv(&chan[stages], &v) == 0)
+		*sum += v;
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct timespec start, end;
+	worker_t *thread;
+	long sum = 0, k;
+	int capacity;
+	double secs;
+
+	stages = argc > 1 ? atoi(argv[1]) : DEFAULT_STAGES;
+	items = argc > 2 ? atoi(argv[2]) : DEFAULT_ITEMS;
+	capacity = argc > 3 ? atoi(argv[3]) : DEFAULT_CAPACITY;
+	if (stages < 1 || items < 1 || capacity < 0)
+	{
+		printf("usage: pipeline [stages] [items] [channel capacity]\n");
+		return 0;
+	}
+
+	chan = (worker_chan_t *)malloc((stages + 1) * sizeof(worker_chan_t));
+	thread = (worker_t *)malloc((stages + 2) * sizeof(worker_t));
+	for (k = 0; k <= stages; k++)
+		worker_chan_init(&chan[k], sizeof(long), capacity);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	worker_create(&thread[0], NULL, &source, NULL);
+	for (k = 0; k < stages; k++)
+		worker_create(&thread[k + 1], NULL, &stage, (void *)k);
+	worker_create(&thread[stages + 1], NULL, &sink, &sum);
+	for (k = 0; k < stages + 2; k++)
+		worker_join(thread[k], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%d items through %d stages (capacity %d) in %.3f s: %.0f items/s, %.0f ns per hop\n",
+		   items, stages, capacity, secs, items / secs, secs * 1e9 / ((double)items * (stages + 1)));
+	if (sum != (long)items * (items - 1) / 2 + (long)items * stages)
+		printf("checksum mismatch: %ld\n", sum);
+
+	for (k = 0; k <= stages; k++)
+		worker_chan_destroy(&chan[k]);
+	free(chan);
+	free(thread);
+	return 0;
+}
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include "../thread-worker.h"
+
+#define DEFAULT_HOGS 4
+#define DEFAULT_ROUNDS 200
+#define HOLD_NS 15000000LL // how long the low thread keeps the mutex
+#define PAUSE_NS 20000000LL // between the high thread's locks
+
+/* A low-priority thread takes a mutex for a couple of ms at a time,
+ * while hogs keep one carrier busy and a high-priority thread now and
+ * then needs the same mutex. Built with SCHED=MLFQ the low thread
+ * starts at the bottom level, so without priority inheritance the high
+ * thread waits for the hogs too. Prints how long the high thread waited
+ * for the lock and how often a waiter had to raise the owner's level. */
+
+worker_mutex_t mutex;
+volatile int stop = 0;
+long long *waited;
+
+long long now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void busy(long long ns)
+{
+	long long until = now() + ns;
+
+	while (now() < until)
+		;
+}
+
+void *low(void *arg)
+{
+	while (!stop)
+	{
+		worker_mutex_lock(&mutex);
+		busy(HOLD_NS);
+		worker_mutex_unlock(&mutex);
+		worker_sleep_ns(HOLD_NS / 4);
+	}
+	return NULL;
+}
+
+void *hog(void *arg)
+{
+	while (!stop)
+		busy(100000);
+	return NULL;
+}
+
+void *high(void *arg)
+{
+	int rounds = *(int *)arg, i;
+	long long start;
+
+	for (i = 0; i < rounds; i++)
+	{
+		worker_sleep_ns(PAUSE_NS);
+		start = now();
+		worker_mutex_lock(&mutex);
+		waited[i] = now() - start;
+		worker_mutex_unlock(&mutex);
+	}
+	return NULL;
+}
+
+int compare(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* a thread created at sched_priority prio */
+void spawn(worker_t *thread, int prio, void *(*fn)(void *), void *arg)
+{
+	pthread_attr_t attr;
+	struct sched_param param;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_RR);
+	param.sched_priority = prio;
+	pthread_attr_setschedparam(&attr, &param);
+	worker_create(thread, &attr, fn, arg);
+	pthread_attr_destroy(&attr);
+}
+
+int main(int argc, char **argv)
+{
+	worker_mutex_stats_t stats;
+	worker_t low_thread, high_thread, *hogs;
+	int hog_num, rounds, i;
+
+	hog_num = argc > 1 ? atoi(argv[1]) : DEFAULT_HOGS;
+	rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_ROUNDS;
+	if (hog_num < 0 || rounds < 1)
+	{
+		printf("usage: priority_inversion [hogs] [rounds]\n");
+		return 0;
+	}
+	// one carrier, so the hogs and the low thread really compete
+	setenv("WORKER_CARRIERS", "1", 0);
+
+	hogs = (worker_t *)malloc((hog_num + 1) * sizeof(worker_t));
+	waited = (long long *)malloc(rounds * sizeof(long long));
+	worker_mutex_init(&mutex, NULL);
+
+	spawn(&low_thread, 1, &low, NULL);
+	for (i = 0; i < hog_num; i++)
+		spawn(&hogs[i], 50, &hog, NULL);
+	spawn(&high_thread, 99, &high, &rounds);
+
+	worker_join(high_thread, NULL);
+	stop = 1;
+	worker_join(low_thread, NULL);
+	for (i = 0; i < hog_num; i++)
+		worker_join(hogs[i], NULL);
+
+	worker_mutex_stats(&mutex, &stats);
+	qsort(waited, rounds, sizeof(long long), compare);
+	printf("%d hogs, %d locks by the high thread: wait p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+		   hog_num, rounds, waited[rounds / 2] / 1e6, waited[rounds * 99 / 100] / 1e6,
+		   waited[rounds - 1] / 1e6);
+	printf("%lu acquisitions, %lu contended, %lu inversions\n",
+		   stats.acquisitions, stats.contended, stats.inversions);
+
+	worker_mutex_destroy(&mutex);
+	free(hogs);
+	free(waited);
+	return 0;
+}
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "../thread-worker.h"
+
+#define DEFAULT_THREAD_NUM 1000
+#define DEFAULT_MAX_MS 1000
+
+/* Every thread sleeps once for a random time up to max_ms with
+ * worker_sleep_ns and records how late it woke up. Nothing spins, so
+ * the process should use next to no CPU while they wait. */
+
+unsigned long long *want;
+long long *late;
+
+unsigned long long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void *sleeper(void *arg)
+{
+	long i = (long)arg;
+	unsigned long long start = now_ns();
+
+	worker_sleep_ns(want[i]);
+	late[i] = (long long)(now_ns() - start) - (long long)want[i];
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct rusage usage;
+	long long min = 0, max = 0;
+	double sum = 0, cpu;
+	int thread_num, max_ms, i;
+	worker_t *thread;
+
+	thread_num = argc > 1 ? atoi(argv[1]) : DEFAULT_THREAD_NUM;
+	max_ms = argc > 2 ? atoi(argv[2]) : DEFAULT_MAX_MS;
+	if (thread_num < 1 || max_ms < 1)
+	{
+		printf("usage: sleep_accuracy [threads] [max_ms]\n");
+		return 0;
+	}
+
+	thread = (worker_t *)malloc(thread_num * sizeof(worker_t));
+	want = (unsigned long long *)malloc(thread_num * sizeof(unsigned long long));
+	late = (long long *)malloc(thread_num * sizeof(long long));
+
+	srand(1);
+	for (i = 0; i < thread_num; i++)
+	{
+		want[i] = (unsigned long long)(rand() % (max_ms * 1000)) * 1000;
+		worker_create(&thread[i], NULL, &sleeper, (void *)(long)i);
+	}
+	for (i = 0; i < thread_num; i++)
+	{
+		worker_join(thread[i], NULL);
+	}
+
+	for (i = 0; i < thread_num; i++)
+	{
+		if (i == 0 || late[i] < min)
+			min = late[i];
+		if (i == 0 || late[i] > max)
+			max = late[i];
+		sum += late[i];
+	}
+	getrusage(RUSAGE_SELF, &usage);
+	cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+		  (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+
+	printf("%d sleeps up to %d ms: late by min %.3f ms, avg %.3f ms, max %.3f ms; %.3f s of CPU\n",
+		   thread_num, max_ms, min / 1e6, sum / thread_num / 1e6, max / 1e6, cpu);
+
+	free(thread);
+	free(want);
+	free(late);
+	return 0;
+}
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include "../thread-worker.h"
+
+#define DEFAULT_THREAD_NUM 999
+#define DEFAULT_SECONDS 10
+#define CLASSES 3
+
+/* Threads in three priority classes spin for a fixed time. Built with
+ * SCHED=CFS each class should get CPU in proportion to its weight:
+ * sched_priority 37, 50 and 62 under SCHED_RR are nice 5, 0 and -5,
+ * weights 335, 1024 and 3121. Other policies share evenly. */
+
+int priority[CLASSES] = {37, 50, 62};
+int weight[CLASSES] = {335, 1024, 3121};
+
+volatile int stop = 0;
+unsigned long *work;
+
+void *spin(void *arg)
+{
+	unsigned long *count = (unsigned long *)arg;
+
+	while (!stop)
+	{
+		(*count)++;
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct timespec start, now;
+	pthread_attr_t attr[CLASSES];
+	struct sched_param param;
+	double total = 0, class_total[CLASSES] = {0}, weight_total = 0;
+	int thread_num, seconds, i, k;
+	worker_t *thread;
+
+	thread_num = argc > 1 ? atoi(argv[1]) : DEFAULT_THREAD_NUM;
+	seconds = argc > 2 ? atoi(argv[2]) : DEFAULT_SECONDS;
+	if (thread_num < CLASSES || seconds < 1)
+	{
+		printf("usage: weighted_share [threads] [seconds]\n");
+		return 0;
+	}
+
+	// one carrier so the shares come from the policy, not from parallelism
+	setenv("WORKER_CARRIERS", "1", 0);
+
+	thread = (worker_t *)malloc(thread_num * sizeof(worker_t));
+	work = (unsigned long *)calloc(thread_num, sizeof(unsigned long));
+
+	for (k = 0; k < CLASSES; k++)
+	{
+		pthread_attr_init(&attr[k]);
+		pthread_attr_setschedpolicy(&attr[k], SCHED_RR);
+		param.sched_priority = priority[k];
+		pthread_attr_setschedparam(&attr[k], &param);
+	}
+
+	for (i = 0; i < thread_num; i++)
+		worker_create(&thread[i], &attr[i % CLASSES], &spin, &work[i]);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do
+	{
+		worker_yield();
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (now.tv_sec - start.tv_sec < seconds);
+	stop = 1;
+
+	for (i = 0; i < thread_num; i++)
+		worker_join(thread[i], NULL);
+
+	for (i = 0; i < thread_num; i++)
+	{
+		class_total[i % CLASSES] += work[i];
+		total += work[i];
+	}
+	for (k = 0; k < CLASSES; k++)
+		weight_total += weight[k];
+
+	for (k = 0; k < CLASSES; k++)
+	{
+		// spread of the threads inside the class around their mean
+		int n = 0;
+		double mean, var = 0;
+		for (i = k; i < thread_num; i += CLASSES)
+			n++;
+		mean = class_total[k] / n;
+		for (i = k; i < thread_num; i += CLASSES)
+			var += (work[i] - mean) * (work[i] - mean);
+
+		printf("priority %2d (weight %4d): %5.1f%% of the CPU, fair share %5.1f%%, "
+			   "thread spread %.1f%%\n",
+			   priority[k], weight[k], 100 * class_total[k] / total,
+			   100 * weight[k] / weight_total, mean > 0 ? 100 * sqrt(var / n) / mean : 0);
+	}
+
+	free(thread);
+	free(work);
+	return 0;
+}
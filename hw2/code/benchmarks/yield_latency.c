@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../thread-worker.h"
+
+#define DEFAULT_ROUNDS 1000000
+
+/* Main and one worker yield back and forth on a single carrier, so each
+ * pass of main's loop is one yield round trip: main -> worker -> main. */
+
+int rounds;
+
+void *pong(void *arg)
+{
+	int i;
+
+	for (i = 0; i < rounds; i++)
+	{
+		worker_yield();
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct timespec start, end;
+	worker_t thread;
+	double ns;
+	int i;
+
+	rounds = argc > 1 ? atoi(argv[1]) : DEFAULT_ROUNDS;
+	if (rounds < 1)
+	{
+		printf("enter a valid number of rounds\n");
+		return 0;
+	}
+
+	// one carrier, otherwise the two would just run side by side
+	setenv("WORKER_CARRIERS", "1", 0);
+
+	worker_create(&thread, NULL, &pong, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < rounds; i++)
+	{
+		worker_yield();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	worker_join(thread, NULL);
+
+	ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	printf("yield round trip: %.1f ns over %d rounds\n", ns / rounds, rounds);
+	return 0;
+}
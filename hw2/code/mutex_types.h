@@ -5,12 +5,109 @@
 #include "thread_worker_types.h"
 
 
+/* contention counters of a mutex, see worker_mutex_stats() */
+typedef struct worker_mutex_stats_t
+{
+    unsigned long acquisitions;
+    unsigned long contended;        // acquisitions that found it held
+    unsigned long long wait_ns;     // total time contended lockers waited
+    unsigned long long max_hold_ns; // longest it was held
+    unsigned long inversions;       // MLFQ: times a waiter raised the owner's level
+} worker_mutex_stats_t;
+
 /* mutex struct definition */
 typedef struct worker_mutex_t
 {
     /* add something here */
-    atomic_flag is_locked;
-    // YOUR CODE HERE
+    atomic_flag wait_lock;  // guards the fields below
+    int locked;
+    tcb *owner;             // holder, NULL if taken from outside a worker
+    tcb *wait_head;         // parked lockers in FIFO order, linked through tcb->next
+    tcb *wait_tail;
+    int lent;               // MLFQ: a waiter raised the owner's level
+    unsigned long long acquired_at; // when the owner got it
+    long long avg_hold_ns;          // recent hold times, sets the spin budget
+    worker_mutex_stats_t stats;
 } worker_mutex_t;
 
+/* Condition variable. Like the mutex, all zero means no waiters. */
+typedef struct worker_cond_t
+{
+    atomic_flag lock;       // guards the fields below
+    tcb *wait_head;         // parked waiters in FIFO order, linked through tcb->next
+    tcb *wait_tail;
+    worker_mutex_t *mutex;  // the mutex the waiters released
+} worker_cond_t;
+
+/* Counting semaphore */
+typedef struct worker_sem_t
+{
+    atomic_flag lock;
+    int value;
+    tcb *wait_head;         // parked in worker_sem_wait, FIFO
+    tcb *wait_tail;
+} worker_sem_t;
+
+#define WORKER_BARRIER_SERIAL_THREAD -1 // returned to one thread per round
+
+/* Barrier for count threads */
+typedef struct worker_barrier_t
+{
+    atomic_flag lock;
+    unsigned int count;     // threads per round
+    unsigned int waiting;   // arrived this round
+    unsigned int round;     // bumped when a round completes
+    tcb *waiters;
+} worker_barrier_t;
+
+/* Reader-writer lock. New readers queue behind a waiting writer, and a
+ * writer leaving lets every waiting reader in, so neither side starves. */
+typedef struct worker_rwlock_t
+{
+    atomic_flag lock;
+    int readers;            // holding it shared
+    int writer;             // held exclusively
+    tcb *read_waiters;      // woken together, in no particular order
+    tcb *write_head;        // FIFO
+    tcb *write_tail;
+} worker_rwlock_t;
+
+/* Tasks started by worker_task_group_run(), waited for together. All zero
+ * is an empty group. */
+typedef struct worker_task_group_t
+{
+    atomic_flag lock;       // guards the fields below
+    long pending;           // started and not finished yet
+    tcb *waiters;           // parked in worker_task_group_wait
+} worker_task_group_t;
+
+/* Bounded channel of elem_size byte values, any number of senders and
+ * receivers. Senders park while it is full, receivers while it is empty. */
+typedef struct worker_chan_t
+{
+    atomic_flag lock;       // guards the fields below
+    size_t elem_size;
+    unsigned int capacity;  // 0: unbuffered, a send waits for its receiver
+    unsigned int head;      // slot of the oldest value in buf
+    unsigned int count;     // values in buf
+    char *buf;
+    int closed;
+    chan_waiter_t *send_head; // parked senders, FIFO
+    chan_waiter_t *send_tail;
+    chan_waiter_t *recv_head; // parked receivers, FIFO
+    chan_waiter_t *recv_tail;
+} worker_chan_t;
+
+#define WORKER_CHAN_SEND 0
+#define WORKER_CHAN_RECV 1
+#define WORKER_CHAN_SELECT_MAX 16 // cases one worker_chan_select() can wait on
+
+/* One case of a worker_chan_select() */
+typedef struct worker_chan_case_t
+{
+    worker_chan_t *chan;    // NULL: never chosen
+    int op;                 // WORKER_CHAN_SEND or WORKER_CHAN_RECV
+    void *elem;             // value to send, or where to receive one (may be NULL)
+} worker_chan_case_t;
+
 #endif
\ No newline at end of file
@@ -0,0 +1,403 @@
+// File:	pthread-shim.c
+
+// Runs unmodified pthread programs on worker threads:
+//
+//   make shim
+//   LD_PRELOAD=./libworker-pthread.so ./program
+//
+// pthread_create, _join, _detach, _exit, _yield and the pthread_mutex_*
+// and pthread_cond_* calls below are taken over and routed to worker_*.
+// So are sleep, usleep and nanosleep, which park the worker, and fsync
+// and fdatasync, which move it off its carrier while the disk catches
+// up. The rest of the pthread API still goes to glibc. Workers share their
+// carrier's thread-local storage, so __thread variables are per carrier,
+// not per thread, and pthread_self() names the carrier.
+
+#include "thread-worker.h"
+#include "thread_worker_types.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* A pthread_mutex_t is too small for a worker_mutex_t: it holds a pointer
+ * to one, made the first time the mutex is used. All zero is still an
+ * unlocked mutex, as PTHREAD_MUTEX_INITIALIZER promises. */
+typedef struct ShimMutex
+{
+    worker_mutex_t mutex;
+    int kind;               // PTHREAD_MUTEX_NORMAL, _RECURSIVE or _ERRORCHECK
+    unsigned int depth;     // recursive: times the owner locked it again
+} shim_mutex_t;
+
+/* A worker_cond_t fits in a pthread_cond_t, with the clock its timeouts
+ * are given in. All zero is CLOCK_REALTIME. */
+typedef struct ShimCond
+{
+    worker_cond_t cond;
+    clockid_t clock;
+} shim_cond_t;
+
+_Static_assert(sizeof(shim_mutex_t *) <= sizeof(pthread_mutex_t), "pthread_mutex_t can't hold a pointer");
+_Static_assert(sizeof(shim_cond_t) <= sizeof(pthread_cond_t), "worker_cond_t doesn't fit in pthread_cond_t");
+
+// in thread-worker.c
+extern int (*carrier_spawn)(pthread_t *, const pthread_attr_t *, void *(*)(void *), void *);
+tcb *current_tcb();
+
+static void (*real_pthread_exit)(void *);
+static int (*real_nanosleep)(const struct timespec *, struct timespec *);
+static int (*real_fsync)(int);
+static int (*real_fdatasync)(int);
+
+static shim_mutex_t *shim_mutex(pthread_mutex_t *mutex);
+static int owned(shim_mutex_t *m);
+static void to_realtime(clockid_t clock, const struct timespec *abstime, struct timespec *realtime);
+
+/* Find glibc's pthread_create for the carriers before anything runs */
+__attribute__((constructor)) static void shim_init()
+{
+    carrier_spawn = dlsym(RTLD_NEXT, "pthread_create");
+    real_pthread_exit = dlsym(RTLD_NEXT, "pthread_exit");
+    real_nanosleep = dlsym(RTLD_NEXT, "nanosleep");
+    real_fsync = dlsym(RTLD_NEXT, "fsync");
+    real_fdatasync = dlsym(RTLD_NEXT, "fdatasync");
+    if (carrier_spawn == NULL || real_pthread_exit == NULL || real_nanosleep == NULL ||
+        real_fsync == NULL || real_fdatasync == NULL)
+    {
+        fprintf(stderr, "pthread shim: %s\n", dlerror());
+        exit(1);
+    }
+}
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*start_routine)(void *), void *arg)
+{
+    worker_t worker;
+    int ret = worker_create(&worker, (pthread_attr_t *)attr, start_routine, arg);
+
+    if (ret == 0)
+    {
+        *thread = worker;
+    }
+    return ret;
+}
+
+int pthread_join(pthread_t thread, void **retval)
+{
+    return worker_join((worker_t)thread, retval);
+}
+
+int pthread_detach(pthread_t thread)
+{
+    return worker_detach((worker_t)thread);
+}
+
+void pthread_exit(void *retval)
+{
+    // only returns when called from outside a worker
+    worker_exit(retval);
+    real_pthread_exit(retval);
+    __builtin_unreachable();
+}
+
+int pthread_yield()
+{
+    return worker_yield();
+}
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr)
+{
+    shim_mutex_t *m = (shim_mutex_t *)calloc(1, sizeof(shim_mutex_t));
+
+    if (m == NULL)
+    {
+        return ENOMEM;
+    }
+    worker_mutex_init(&m->mutex, attr);
+    m->kind = PTHREAD_MUTEX_NORMAL;
+    if (attr != NULL)
+    {
+        pthread_mutexattr_gettype(attr, &m->kind);
+    }
+    // whatever was in there before init means nothing
+    __atomic_store_n((shim_mutex_t **)mutex, m, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t *mutex)
+{
+    shim_mutex_t *m = __atomic_load_n((shim_mutex_t **)mutex, __ATOMIC_ACQUIRE);
+    int ret;
+
+    if (m == NULL)
+    {
+        return 0; // never used
+    }
+    if ((ret = worker_mutex_destroy(&m->mutex)) != 0)
+    {
+        return ret;
+    }
+    __atomic_store_n((shim_mutex_t **)mutex, NULL, __ATOMIC_RELAXED);
+    free(m);
+    return 0;
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+    shim_mutex_t *m = shim_mutex(mutex);
+
+    if (m->kind != PTHREAD_MUTEX_NORMAL && owned(m))
+    {
+        if (m->kind != PTHREAD_MUTEX_RECURSIVE)
+        {
+            return EDEADLK;
+        }
+        m->depth++;
+        return 0;
+    }
+    return worker_mutex_lock(&m->mutex);
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+    shim_mutex_t *m = shim_mutex(mutex);
+
+    if (m->kind == PTHREAD_MUTEX_RECURSIVE && owned(m))
+    {
+        m->depth++;
+        return 0;
+    }
+    return worker_mutex_trylock(&m->mutex);
+}
+
+int pthread_mutex_timedlock(pthread_mutex_t *mutex, const struct timespec *abstime)
+{
+    return pthread_mutex_clocklock(mutex, CLOCK_REALTIME, abstime);
+}
+
+int pthread_mutex_clocklock(pthread_mutex_t *mutex, clockid_t clock, const struct timespec *abstime)
+{
+    shim_mutex_t *m = shim_mutex(mutex);
+    struct timespec realtime;
+
+    if (m->kind != PTHREAD_MUTEX_NORMAL && owned(m))
+    {
+        if (m->kind != PTHREAD_MUTEX_RECURSIVE)
+        {
+            return EDEADLK;
+        }
+        m->depth++;
+        return 0;
+    }
+    to_realtime(clock, abstime, &realtime);
+    return worker_mutex_timedlock(&m->mutex, &realtime);
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *mutex)
+{
+    shim_mutex_t *m = shim_mutex(mutex);
+
+    if (m->kind != PTHREAD_MUTEX_NORMAL)
+    {
+        if (!owned(m))
+        {
+            return EPERM;
+        }
+        if (m->depth > 0)
+        {
+            m->depth--;
+            return 0;
+        }
+    }
+    return worker_mutex_unlock(&m->mutex);
+}
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr)
+{
+    shim_cond_t *c = (shim_cond_t *)cond;
+
+    memset(c, 0, sizeof(shim_cond_t));
+    worker_cond_init(&c->cond, NULL);
+    c->clock = CLOCK_REALTIME;
+    if (attr != NULL)
+    {
+        pthread_condattr_getclock(attr, &c->clock);
+    }
+    return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t *cond)
+{
+    return worker_cond_destroy(&((shim_cond_t *)cond)->cond);
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    shim_mutex_t *m = shim_mutex(mutex);
+    unsigned int depth = m->depth;
+    int ret;
+
+    // a recursive mutex is released all the way, and taken back as deep
+    m->depth = 0;
+    ret = worker_cond_wait(&((shim_cond_t *)cond)->cond, &m->mutex);
+    m->depth = depth;
+    return ret;
+}
+
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                           const struct timespec *abstime)
+{
+    return pthread_cond_clockwait(cond, mutex, ((shim_cond_t *)cond)->clock, abstime);
+}
+
+int pthread_cond_clockwait(pthread_cond_t *cond, pthread_mutex_t *mutex, clockid_t clock,
+                           const struct timespec *abstime)
+{
+    shim_mutex_t *m = shim_mutex(mutex);
+    unsigned int depth = m->depth;
+    struct timespec realtime;
+    int ret;
+
+    to_realtime(clock, abstime, &realtime);
+    m->depth = 0;
+    ret = worker_cond_timedwait(&((shim_cond_t *)cond)->cond, &m->mutex, &realtime);
+    m->depth = depth;
+    return ret;
+}
+
+int pthread_cond_signal(pthread_cond_t *cond)
+{
+    return worker_cond_signal(&((shim_cond_t *)cond)->cond);
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond)
+{
+    return worker_cond_broadcast(&((shim_cond_t *)cond)->cond);
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem)
+{
+    if (current_tcb() == NULL)
+    {
+        return real_nanosleep(req, rem);
+    }
+    if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000L)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    // parked workers aren't interrupted by signals, nothing is left over
+    worker_sleep_ns(req->tv_sec * 1000000000ULL + req->tv_nsec);
+    if (rem != NULL)
+    {
+        rem->tv_sec = 0;
+        rem->tv_nsec = 0;
+    }
+    return 0;
+}
+
+/* glibc's sleep and usleep don't go through nanosleep's symbol */
+unsigned int sleep(unsigned int seconds)
+{
+    struct timespec req = {seconds, 0};
+    nanosleep(&req, NULL);
+    return 0;
+}
+
+int usleep(useconds_t usec)
+{
+    struct timespec req = {usec / 1000000, (usec % 1000000) * 1000L};
+    return nanosleep(&req, NULL);
+}
+
+/* errno of whichever kernel thread we are on now. Never inlined: GCC
+ * takes __errno_location() for const and would reuse the one from
+ * before worker_blocking_end(), which belongs to the spare thread. */
+__attribute__((noinline)) static void set_errno(int value)
+{
+    errno = value;
+}
+
+int fsync(int fd)
+{
+    int ret, saved_errno;
+
+    worker_blocking_begin();
+    ret = real_fsync(fd);
+    saved_errno = errno;
+    worker_blocking_end();
+    set_errno(saved_errno);
+    return ret;
+}
+
+int fdatasync(int fd)
+{
+    int ret, saved_errno;
+
+    worker_blocking_begin();
+    ret = real_fdatasync(fd);
+    saved_errno = errno;
+    worker_blocking_end();
+    set_errno(saved_errno);
+    return ret;
+}
+
+/* The worker mutex behind mutex, made on first use. A statically
+ * initialized one says in glibc's kind field whether it is recursive
+ * or error checking; the pointer only covers the words before it. */
+static shim_mutex_t *shim_mutex(pthread_mutex_t *mutex)
+{
+    shim_mutex_t **slot = (shim_mutex_t **)mutex;
+    shim_mutex_t *m = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    shim_mutex_t *none = NULL;
+
+    if (m != NULL)
+    {
+        return m;
+    }
+    m = (shim_mutex_t *)calloc(1, sizeof(shim_mutex_t));
+    if (m == NULL)
+    {
+        perror("pthread shim");
+        exit(1);
+    }
+    m->kind = mutex->__data.__kind & 3;
+    if (m->kind != PTHREAD_MUTEX_RECURSIVE && m->kind != PTHREAD_MUTEX_ERRORCHECK)
+    {
+        m->kind = PTHREAD_MUTEX_NORMAL;
+    }
+    // whoever loses the race to set it up uses the winner's
+    if (!__atomic_compare_exchange_n(slot, &none, m, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        free(m);
+        m = none;
+    }
+    return m;
+}
+
+/* the calling worker holds m */
+static int owned(shim_mutex_t *m)
+{
+    tcb *self = current_tcb();
+    return self != NULL && __atomic_load_n(&m->mutex.owner, __ATOMIC_RELAXED) == self;
+}
+
+/* abstime on clock, as a CLOCK_REALTIME time */
+static void to_realtime(clockid_t clock, const struct timespec *abstime, struct timespec *realtime)
+{
+    struct timespec now, now_real;
+    long long ns;
+
+    if (clock == CLOCK_REALTIME)
+    {
+        *realtime = *abstime;
+        return;
+    }
+    clock_gettime(clock, &now);
+    clock_gettime(CLOCK_REALTIME, &now_real);
+    ns = (abstime->tv_sec - now.tv_sec) * 1000000000LL + (abstime->tv_nsec - now.tv_nsec) +
+         now_real.tv_sec * 1000000000LL + now_real.tv_nsec;
+    realtime->tv_sec = ns / 1000000000LL;
+    realtime->tv_nsec = ns % 1000000000LL;
+}
@@ -3,7 +3,7 @@
 // List all group member's name:
 /* Nicholas Chen nhc29
    Pavan Kumar Kokkiligadda pkk46
- */ 
+ */
 // username of iLab:
 // iLab Server:
 //ilab1
@@ -11,126 +11,488 @@
 #include "thread-worker.h"
 #include "thread_worker_types.h"
 
-#define STACK_SIZE 16 * 1024
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <linux/futex.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define STACK_SIZE 256 * 1024    // reserved only: pages are committed as the stack grows into them
+#define SCHED_STACK_SIZE 64 * 1024
 #define QUANTUM 10 * 1000
-#define THREAD_AMT 4096
+#define BOOST_PERIOD 500 * 1000  // MLFQ moves every thread back to the top this often
+#define CFS_MIN_SLICE 100000LL   // shortest CFS deadline, in ns
+#define CFS_GRANULARITY 1000000LL // vruntime ns a CFS thread may get ahead before it is preempted
+#define CFS_LATENCY 6000000ULL   // ns of vruntime credit a sleeper keeps, times two
+#define CFS_BALANCE 16           // CFS picks between looks at the most loaded carrier
+#define NICE_0_WEIGHT 1024
+
+#if defined(MLFQ) && defined(CFS)
+#error "pick one scheduling policy: MLFQ or CFS"
+#endif
+#if defined(MLFQ)
+#define POLICY_NAME "MLFQ"
+#elif defined(CFS)
+#define POLICY_NAME "CFS"
+#else
+#define POLICY_NAME "RR"
+#endif
+#define TCB_INDEX_BITS 22        // worker_t: low bits index the tcb table,
+#define TCB_INDEX_MASK ((1u << TCB_INDEX_BITS) - 1) // the rest count its reuses
+#define MAX_THREADS (1 << TCB_INDEX_BITS)
+#define TCB_CHUNK 1024           // tcbs the table grows by
+#define MAX_CARRIERS 64
+#define GUARD_SIZE 4096          // PROT_NONE page under every pooled stack
+#define STACK_CACHE_MAX 64       // stacks a carrier keeps per size class before sharing them
+#define STACK_SLAB 64            // pooled stacks carved from one mapping
+#define STACK_PAINT 0x5a5a5a5a5a5a5a5aULL // fills stacks with WORKER_STACK_DEBUG=1
+#define HEAP_SLAB (64 * 1024)    // worker_malloc slab size and alignment
+#define HEAP_CHUNK 32            // slabs mapped at once
+#define HEAP_HEADER 64           // heap_slab_t and padding in front of a slab's objects
+#define HEAP_MIN 16              // smallest worker_malloc size class
+#define SPARE_MAX 1024           // kernel threads workers blocking in the kernel may get
+#define SPIN_MAX_NS 50 * 1000    // longest a mutex locker spins before parking
+#define IO_CHUNK 1024            // fds the I/O table grows by
+#define MAX_FDS (1 << 20)
+#define IO_EVENTS 64             // epoll events taken per io_poll()
+#define IO_LOCAL 8               // fds worker_poll() watches without malloc
+#define WHEEL_TICK 100000ULL     // ns per timer wheel tick
+#define WHEEL_BITS 6             // 64 slots per wheel level
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4           // 2^24 ticks, about 28 minutes; longer timeouts wait in the top level
+#define TRACE_EVENTS (1 << 16)   // records the trace ring keeps, must be a power of two
+#define CALIBRATE_NS 1000000L    // how long init_scheduler() times trace_clock() for
+#define TASK_POOL_MAX 256        // task pool workers, counting those that replace blocked ones
+#define FOR_PIECES 8             // worker_parallel_for() pieces per carrier, without a grain
+#define TASK_STACK_RESERVE (STACK_SIZE / 4) // stack left free when a waiter runs others' tasks
+#define TASK_NEST_MAX 32         // others' tasks nested on the main thread's stack, whose size we don't know
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() do { } while (0)
+#endif
 
-#define NUM_LEVELS 4 // You can adjust the number of priority levels as needed
-q_t mlfq[NUM_LEVELS];
-// Add a variable to keep track of the current priority level
-// int current_priority = 0;
 // Add a variable to store the time quantum for each priority level
 int quantum[NUM_LEVELS] = {10, 20, 40, 80};
+// ms of CPU a thread may use at a level, over all its slices, before it
+// drops a level. The bottom level keeps everything that gets there.
+int allotment[NUM_LEVELS] = {20, 40, 80, 160};
+
+// CFS: weight of each nice level from -20 to 19, as in Linux. Each step
+// is about 10% more or less CPU than its neighbour.
+static const unsigned int nice_to_weight[40] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548, 7620, 6100, 4904, 3906,
+    3121, 2501, 1991, 1586, 1277,
+    1024, 820, 655, 526, 423,
+    335, 272, 215, 172, 137,
+    110, 87, 70, 56, 45,
+    36, 29, 23, 18, 15,
+};
 
-static int is_running[THREAD_AMT];
-static void *return_value[THREAD_AMT];
+// All tcbs live in a table of chunks that only grows, indexed by the low
+// bits of a worker_t, so a handle finds its tcb in O(1) and a tcb never
+// moves or goes away. Free slots are recycled through tcb_free_list.
+static tcb *tcb_chunks[MAX_THREADS / TCB_CHUNK];
+static unsigned int tcb_count = 0; // slots handed out so far
+static tcb *tcb_free_list;
+static atomic_flag tcb_lock = ATOMIC_FLAG_INIT;
 
 // INITIALIZE ALL YOUR OTHER VARIABLES HERE
 int init_sched_finish = 0;
-worker_t id = 0;
-ucontext_t sched_context, main_context;
-q_t q;
+
+// M:N state: num_carriers kernel threads each run schedule() on their own queues
+carrier_t carriers[MAX_CARRIERS];
+int num_carriers = 0;
+// Starts the carriers' kernel threads. The pthread shim takes over
+// pthread_create itself, so it points this at the real one.
+int (*carrier_spawn)(pthread_t *, const pthread_attr_t *, void *(*)(void *), void *) = &pthread_create;
+
+// Workers between worker_blocking_begin() and _end() run on spare kernel
+// threads, so their carrier goes on with the others. Handed-off workers
+// wait in blocking_head for a spare to pick them up.
+static tcb *blocking_head, *blocking_tail;
+static atomic_flag blocking_lock = ATOMIC_FLAG_INIT; // guards the queue and the counts
+static int spare_threads = 0;
+static int spare_idle = 0;
+static unsigned int spare_seq = 0; // futex word idle spares sleep on
+
+// Threads that did not fit in a carrier deque, or came from outside one
+static tcb *inject_head, *inject_tail;
+static atomic_flag inject_lock = ATOMIC_FLAG_INIT;
+
+// Task pool: one worker per carrier runs the tasks, each from its own
+// deque first, stealing from the others when it runs dry. Tasks started
+// outside the pool wait in the task inject queue. A worker parked inside
+// a task is replaced by a new one, up to TASK_POOL_MAX.
+static task_deque_t *task_deques[TASK_POOL_MAX]; // the first task_pool_size are in use
+static int task_pool_size = 0;
+static int task_pool_blocked = 0;  // parked while running a task
+static int task_pool_idle = 0;     // parked on task_idle for want of tasks
+static tcb *task_idle;
+static task_t *task_inject_head, *task_inject_tail;
+static atomic_flag task_lock = ATOMIC_FLAG_INIT; // guards the idle list, inject queue and growth
+
+// Stack pool: size classes, and free stacks shared between carriers
+static size_t stack_class_size[STACK_CLASSES] = {16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024};
+static void *stack_free_list[STACK_CLASSES];
+static atomic_flag stack_lock = ATOMIC_FLAG_INIT;
+// worker_malloc: slabs mapped but not given to a heap yet, and the heap
+// of callers outside the carriers
+static char *heap_slab_next, *heap_slab_end;
+static atomic_flag heap_lock = ATOMIC_FLAG_INIT;
+static heap_t shared_heap;
+
+// WORKER_STACK_GUARD=0: no guard pages, so a slab of stacks stays one
+// mapping; vm.max_map_count otherwise caps us at about 32k stacks.
+// WORKER_STACK_TRIM=1: stacks leaving a carrier's cache give back the
+// pages a deep call chain committed, at a syscall per recycled stack.
+static int stack_guard = 1;
+static int stack_trim = 0;
+// WORKER_STACK_DEBUG=1: paint stacks and report how deep each one got
+static int stack_debug = 0;
+static size_t default_stack_size; // glibc's default in pthread_attr_t
+
+#ifdef USE_UCONTEXT
+// Copied into every new worker context so creating one needs no getcontext
+static ucontext_t template_context;
+#endif
+
+// Idle carriers sleep on work_seq; publishing new work bumps it
+static unsigned int work_seq = 0;
+static int nr_idle = 0;
+
+// Parked I/O: one epoll set for all carriers. At most one idle carrier
+// sleeps in it, wake_fd gets it out when other work shows up.
+static int epoll_fd = -1, wake_fd = -1;
+static int io_waiting = 0; // worker_poll() calls parked right now
+static int polling = 0;    // an idle carrier is inside epoll_wait
+static io_fd_t *io_chunks[MAX_FDS / IO_CHUNK];
+static atomic_flag io_table_lock = ATOMIC_FLAG_INIT;
+
+// Timer wheel: WHEEL_LEVELS levels of WHEEL_SLOTS lists, each level's slot
+// spanning a whole lower level. Whichever carrier picks next advances it.
+static wtimer_t *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static unsigned long long wheel_used[WHEEL_LEVELS]; // bit per non-empty slot
+static unsigned long long wheel_next;  // next tick to run
+static int wheel_count = 0;            // pending timers
+static atomic_flag wheel_lock = ATOMIC_FLAG_INIT;
+static unsigned long long idle_deadline; // idle carriers sleep until, 0 while they compute it
+
+// Every thread's time is accounted in trace_clock() ticks. Events also go
+// to trace_ring, overwriting the oldest, when WORKER_TRACE names a file to
+// dump them to at exit.
+static trace_record_t *trace_ring;
+static unsigned long long trace_head = 0;  // records ever written
+static char *trace_path;
+static unsigned long long clock_base_tick, clock_base_ns; // trace_clock() at start
+static double ns_per_tick = 1;             // measured by clock_calibrate()
+static unsigned long done_threads = 0, done_switches = 0; // totals of finished threads
+static unsigned long long done_turnaround = 0, done_response = 0;
+static unsigned long long done_run = 0, done_ready = 0, done_blocked = 0;
+
+// WORKER_PREEMPT=0: no timers, workers only switch when they yield or block
+static int cooperative = 0;
+static int kick_next = 0; // where kick_busy() starts looking
+
+// Per kernel thread: the carrier it backs and the worker it is running.
+// initial-exec keeps each access a single %fs-relative load, so reading
+// them can never straddle a preemption that migrates the worker.
+static __thread carrier_t *self_carrier __attribute__((tls_model("initial-exec")));
+static __thread tcb *self_tcb __attribute__((tls_model("initial-exec")));
+// on a spare kernel thread: the worker it runs, and its own loop to go back to
+static __thread tcb *spare_tcb;
+static __thread worker_ctx_t spare_context;
 
 // Forward Declarations
-void pre_schedule();
 void init_scheduler();
-static void sched_rr();
-static void sched_mlfq();
-void enqueue(tcb *thread);
-tcb *dequeue(q_t *q);
-ucontext_t create_start_worker_context(ucontext_t *uctx);
-void start_worker(ucontext_t *ctx);
-void mlfq_enqueue(tcb *thread, int priority);
-tcb *mlfq_dequeue(int priority);
+static void schedule();
+#if defined(MLFQ)
+static tcb *sched_mlfq(carrier_t *c);
+static void boost(carrier_t *c, unsigned int epoch);
+#elif !defined(CFS)
+static tcb *sched_rr(carrier_t *c);
+#endif
+static void arm_slice(carrier_t *c, tcb *t);
+static void arm_timer(carrier_t *c, int level, long long ns);
+static void kick_busy();
+static int others_runnable(carrier_t *c);
+static void account(carrier_t *c, tcb *t);
+#ifdef CFS
+static tcb *sched_cfs(carrier_t *c);
+static void cfs_push(carrier_t *c, tcb *t);
+static void cfs_place(carrier_t *c, tcb *t);
+static tcb *cfs_pop(carrier_t *c);
+static tcb *cfs_merge(tcb *a, tcb *b);
+static int cfs_keep_running(carrier_t *c, tcb *t);
+static long long cfs_slice(carrier_t *c, tcb *t);
+static tcb *cfs_take(carrier_t *c);
+static unsigned long long cfs_load(carrier_t *c);
+static void cfs_wake(carrier_t *c, tcb *t);
+static void cfs_balance(carrier_t *c);
+static void cfs_kick(carrier_t *c);
+#endif
+static unsigned int attr_weight(pthread_attr_t *attr);
+static int attr_level(pthread_attr_t *attr);
+static size_t attr_stack_size(pthread_attr_t *attr);
+void start_worker();
+carrier_t *current_carrier();
+tcb *current_tcb();
+static tcb *preempt_disable();
+static void preempt_enable(tcb *t);
+static tcb *pick_next(carrier_t *c);
+static void switch_from(tcb *t);
+static void finish_switch(carrier_t *c);
+static void requeue(carrier_t *c, tcb *t);
+static void park(tcb *t, atomic_flag *lock);
+static void wake(tcb *t);
+static void wake_switch(tcb *self, tcb *t);
+static int mutex_trylock(worker_mutex_t *mutex, tcb *t);
+static int mutex_spin(worker_mutex_t *mutex, unsigned long long start);
+static void mutex_lend(worker_mutex_t *mutex, tcb *waiters, carrier_t *c);
+static int mutex_unlend(worker_mutex_t *mutex, tcb *owner);
+#ifdef MLFQ
+static int mlfq_level(tcb *t);
+#endif
+#ifndef CFS
+static int rq_claim(tcb *t);
+#endif
+static unsigned long long now_ns();
+static void make_ready(tcb *t);
+#ifndef CFS
+static tcb *find_work(carrier_t *c, int levels);
+#endif
+static void rq_push(carrier_t *c, tcb *t);
+static int rq_push_bottom(rq_t *rq, tcb *t);
+#ifndef CFS
+static tcb *rq_take(rq_t *rq);
+#endif
+static long rq_size(rq_t *rq);
+static void inject_push(tcb *t);
+static int io_poll(carrier_t *c, long long timeout);
+static int io_ready(carrier_t *c, int fd, unsigned int revents);
+static int io_watch(io_waiter_t *node, io_wait_t *wait, int fd, unsigned int events);
+static void io_unwatch(io_waiter_t *node);
+static int io_arm(int fd, io_fd_t *f, unsigned int events);
+static io_fd_t *io_entry(int fd, int create);
+static void io_nonblock(int fd);
+static int io_probe(struct pollfd *fds, nfds_t nfds);
+static void timer_init(wtimer_t *timer, tcb *t, atomic_flag *lock, void *wait,
+                       int (*dequeue)(wtimer_t *timer));
+static void timer_add(wtimer_t *timer, unsigned long long deadline);
+static int timer_cancel(wtimer_t *timer);
+static int timer_run();
+static unsigned long long timer_next();
+static void wheel_insert(wtimer_t *timer);
+static void wheel_cascade();
+static void wheel_unlink(wtimer_t *timer);
+static int sleep_dequeue(wtimer_t *timer);
+static int mutex_dequeue(wtimer_t *timer);
+static int join_dequeue(wtimer_t *timer);
+static int poll_dequeue(wtimer_t *timer);
+static void trace(tcb *t, int event, unsigned long long now);
+static unsigned long long trace_clock();
+static void clock_calibrate();
+static unsigned long long ticks_to_ns(unsigned long long ticks);
+static void trace_write(FILE *f);
+static void trace_at_exit();
+static int mutex_lock(worker_mutex_t *mutex, unsigned long long deadline);
+static int mutex_unlock(worker_mutex_t *mutex);
+static int join(worker_t thread, void **value_ptr, unsigned long long deadline);
+static void wake_idle();
+static void wake_all(tcb *list);
+static void task_spawn(task_t *task, worker_task_group_t *group);
+static void task_run(tcb *self, task_t *task);
+static void task_wait(worker_task_group_t *group);
+static void task_notify();
+static task_t *task_find(tcb *self, int others);
+static int task_available();
+static void task_grow();
+static void *task_pool_main(void *arg);
+static void for_run(void *arg);
+static int td_push(task_deque_t *d, task_t *task);
+static task_t *td_pop(task_deque_t *d);
+static task_t *td_steal(task_deque_t *d);
+static int chan_select(worker_chan_case_t *cases, int ncases, int *chosen, int block);
+static int chan_try(worker_chan_case_t *c, chan_wait_t **woken);
+static chan_waiter_t *chan_claim(chan_waiter_t **head, chan_waiter_t **tail);
+static void chan_append(chan_waiter_t **head, chan_waiter_t **tail, chan_waiter_t *w);
+static void chan_unlink(chan_waiter_t **head, chan_waiter_t **tail, chan_waiter_t *w);
+static int chan_lock_all(worker_chan_case_t *cases, int ncases, worker_chan_t **order);
+static void chan_unlock_all(worker_chan_t **order, int n);
+static tcb *chan_wake(chan_wait_t *wait);
+static int cond_wait(worker_cond_t *cond, worker_mutex_t *mutex, unsigned long long deadline);
+static void cond_release(worker_cond_t *cond, int all);
+static int cond_dequeue(wtimer_t *timer);
+static tcb *inject_take();
+static void reap_dead(carrier_t *c);
+static tcb *tcb_alloc();
+static tcb *tcb_lookup(worker_t handle);
+static void tcb_put(tcb *t);
+void *stack_alloc(size_t size);
+void stack_free(void *stack, size_t size);
+static int stack_class(size_t size);
+static void *stack_carve(int cls);
+static void **stack_link(void *stack, int cls);
+static size_t stack_peak(tcb *t);
+static int heap_class(size_t size);
+static heap_t *heap_enter();
+static void heap_leave(heap_t *heap);
+static void *heap_refill(heap_t *heap, int cls);
+static void heap_drain(heap_t *heap);
+static heap_slab_t *heap_slab(void *ptr);
+static void *heap_map(size_t size);
+static void *heap_big(size_t size);
+static void *spare_main(void *arg);
+static void spare_lock();
+void spin_lock(atomic_flag *lock);
+void spin_unlock(atomic_flag *lock);
+static void ctx_make(worker_ctx_t *ctx, void *stack, size_t size, void (*entry)());
+static void ctx_switch(worker_ctx_t *from, worker_ctx_t *to);
 
 /* create a new thread */
 int worker_create(worker_t *thread, pthread_attr_t *attr,
                   void *(*function)(void *), void *arg)
 {
-    // Create Thread Control Block (TCB)
-    tcb *new_tcb = (tcb *)malloc(sizeof(tcb));
-    if (new_tcb == NULL)
+    if (init_sched_finish == 0)
     {
-        perror("MallocTCB");
-        exit(1);
+        init_scheduler();
     }
 
-    ucontext_t *context = malloc(sizeof(ucontext_t));
-    if (context == NULL)
+    // Stay on this carrier while we touch its dead list and stack cache.
+    // This also keeps the timer out of malloc.
+    tcb *self = preempt_disable();
+
+    // Free threads that finished on this carrier since last time
+    if (self != NULL)
     {
-        free(context);
+        reap_dead(current_carrier());
     }
 
-    // Set thread ID
-    new_tcb->thread_id = id++;
-    *thread = id - 1;
-    is_running[id - 1] = 1;
-    // Set thread status
-    new_tcb->status = THREAD_STATUS_READY;
-    // set priority for MLFQ as random number
-    new_tcb->priority = rand() % NUM_LEVELS;
-    // Create and initialize the context of this worker thread
-    if (getcontext(context) < 0)
+    // Create Thread Control Block (TCB), its handle is the thread ID
+    tcb *new_tcb = tcb_alloc();
+    if (new_tcb == NULL)
     {
-        free(new_tcb);
-        exit(1); // Failed to get context
+        preempt_enable(self);
+        return EAGAIN; // MAX_THREADS alive at once
     }
-    // Allocate space for the stack
-    void *stack = malloc(STACK_SIZE);
 
-    if (stack == NULL)
+    // Take a guarded stack of the size attr asks for from the pool, no
+    // syscall once it is warm
+    new_tcb->stack_size = attr_stack_size(attr);
+    new_tcb->stack = stack_alloc(new_tcb->stack_size);
+    if (new_tcb->stack == NULL)
     {
-        free(new_tcb);
-        free(context);
-        exit(1); // Failed to allocate memory for the stack
+        new_tcb->refs = 1;
+        tcb_put(new_tcb);
+        preempt_enable(self);
+        return EAGAIN; // out of memory or mappings for stacks
+    }
+    if (stack_debug)
+    {
+        unsigned long long *word = (unsigned long long *)new_tcb->stack;
+        size_t i;
+        for (i = 0; i < new_tcb->stack_size / sizeof(*word); i++)
+        {
+            word[i] = STACK_PAINT;
+        }
     }
 
-    context->uc_stack.ss_sp = stack;
-    context->uc_stack.ss_size = STACK_SIZE;
-    context->uc_link = NULL;
-    context->uc_flags = 0;
-    context->uc_stack.ss_flags = 0;
+    *thread = new_tcb->thread_id;
+    // one reference held until the thread is reaped, one for its joiner;
+    // nobody joins a detached thread, so it only has the first
+    int detach = PTHREAD_CREATE_JOINABLE;
+    if (attr != NULL)
+    {
+        pthread_attr_getdetachstate(attr, &detach);
+    }
+    new_tcb->refs = detach == PTHREAD_CREATE_DETACHED ? 1 : 2;
+    new_tcb->joined = detach == PTHREAD_CREATE_DETACHED;
+    // Set thread status
+    new_tcb->status = THREAD_STATUS_READY;
+    // MLFQ: threads start at the top level, unless attr has a low priority
+    new_tcb->priority = attr_level(attr);
+    // CFS: its share of the CPU comes from the priority in attr
+    new_tcb->weight = attr_weight(attr);
+    // start_worker re-enables preemption once it is running
+    new_tcb->preempt_off = 1;
+    new_tcb->function = function;
+    new_tcb->arg = arg;
+    trace(new_tcb, TRACE_CREATE, trace_clock());
+    preempt_enable(self);
 
     // Set up the new context to execute the function when it is swapped in.
-    makecontext(context, (void (*)(void))function, 1, arg);
-    new_tcb->context = create_start_worker_context(context);
+    ctx_make(&new_tcb->context, new_tcb->stack, new_tcb->stack_size, &start_worker);
 
-    // After everything is set, push this thread into run queue and make it ready for the execution.
-    // push_to_run_queue(new_tcb);
-    enqueue(new_tcb);
-    // push to mlfq
-    mlfq_enqueue(new_tcb, new_tcb->priority);
+    // After everything is set, push this thread into our carrier's run queue
+    // and make it ready for the execution. Idle carriers will steal it.
+    make_ready(new_tcb);
 
-    if (init_sched_finish == 0)
-    {
-        init_scheduler();
-    }
     return 0;
 }
 
 /* give CPU possession to other user-level worker threads voluntarily */
 int worker_yield()
 {
-    if (swapcontext(&q.head->data->context, &sched_context) < 0)
+    tcb *t = preempt_disable();
+    if (t == NULL)
     {
-        perror("swapcontext");
-        exit(1);
+        return 0; // not called from a worker
     }
 
+    t->status = THREAD_STATUS_READY;
+    switch_from(t);
+    preempt_enable(t);
+
     return 0;
 }
 
 /* terminate a thread */
 void worker_exit(void *value_ptr)
 {
-    // Set status of current thread and free the stack and the tcb
-    q.head->data->status = THREAD_STATUS_FINISHED;
-    return_value[q.head->data->thread_id] = value_ptr;
-    is_running[q.head->data->thread_id] = 0;
-    free(q.head->data->context.uc_stack.ss_sp);
-    mlfq_dequeue(q.head->data->priority);
-    // Move to schedule context
-    setcontext(&sched_context);
+    tcb *t = preempt_disable();
+    if (t == NULL)
+    {
+        return;
+    }
+
+    if (stack_debug && t->stack != NULL)
+    {
+        // the stack is recycled once we are off it, keep the number
+        t->stack_peak = stack_peak(t);
+        fprintf(stderr, "worker %u: stack peak %zu of %zu bytes\n", t->thread_id,
+                t->stack_peak, t->stack_size);
+    }
+
+    // Publish the return value before the joiner can see us as finished.
+    // Whoever runs next frees the stack once we are off it.
+    t->retval = value_ptr;
+    spin_lock(&t->join_lock);
+    __atomic_store_n(&t->status, THREAD_STATUS_FINISHED, __ATOMIC_RELEASE);
+    tcb *joiner = t->joiners;
+    t->joiners = NULL;
+    spin_unlock(&t->join_lock);
+
+    // Wake everyone parked in worker_join on us
+    while (joiner != NULL)
+    {
+        tcb *next = joiner->next;
+        wake(joiner);
+        joiner = next;
+    }
+
+    // Hand the carrier to the next thread, never to come back
+    switch_from(t);
     exit(1);
     return;
 }
@@ -138,345 +500,5012 @@ void worker_exit(void *value_ptr)
 /* Wait for thread termination */
 int worker_join(worker_t thread, void **value_ptr)
 {
+    return join(thread, value_ptr, 0);
+};
 
-    q.head->data->yield_id = thread;
-    q.head->data->status = THREAD_STATUS_BLOCKED;
-    // - wait for a specific thread to terminate
-    // - if value_ptr is provided, retrieve return value from joining thread
-    // - de-allocate any dynamic memory created by the joining thread
+/* worker_join, giving up with ETIMEDOUT after timeout_ns */
+int worker_join_timeout(worker_t thread, void **value_ptr, unsigned long long timeout_ns)
+{
+    return join(thread, value_ptr, now_ns() + timeout_ns);
+}
+
+/* let thread's tcb go as soon as it exits: it can't be joined any more */
+int worker_detach(worker_t thread)
+{
+    tcb *self = preempt_disable();
+    tcb *t = tcb_lookup(thread);
 
-    if (swapcontext(&q.head->data->context, &sched_context) < 0)
+    if (t == NULL)
     {
-        perror("swapcontext");
-        exit(1);
+        preempt_enable(self);
+        return ESRCH;
     }
-    if (value_ptr == NULL)
+    spin_lock(&t->join_lock);
+    if (t->joined)
     {
-        return 0;
+        spin_unlock(&t->join_lock);
+        preempt_enable(self);
+        return EINVAL; // detached already, or someone is joining it
     }
-    *value_ptr = return_value[q.head->data->yield_id];
-    return 0;
-};
+    t->joined = 1;
+    spin_unlock(&t->join_lock);
 
-/* initialize the mutex lock */
-int worker_mutex_init(worker_mutex_t *mutex,
-                      const pthread_mutexattr_t *mutexattr)
-{
-    //- initialize data structures for this mutex
-    __atomic_clear(&mutex->is_locked, __ATOMIC_SEQ_CST);
+    // drop the joiner's reference in its place
+    tcb_put(t);
+    preempt_enable(self);
     return 0;
-};
+}
 
-/* aquire the mutex lock */
-int worker_mutex_lock(worker_mutex_t *mutex)
+/* Join thread, waiting until the monotonic deadline if it isn't 0 */
+static int join(worker_t thread, void **value_ptr, unsigned long long deadline)
 {
-    while (__atomic_test_and_set(&mutex->is_locked, __ATOMIC_SEQ_CST))
+    tcb *self = preempt_disable();
+    tcb *t = tcb_lookup(thread);
+    wtimer_t timer;
+
+    if (t == NULL)
     {
-        worker_yield();
+        preempt_enable(self);
+        return ESRCH; // never created, or a stale handle of a recycled tcb
+    }
+    if (t == self)
+    {
+        preempt_enable(self);
+        return EDEADLK; // we would wait for our own exit forever
     }
-    return 0;
-};
 
-/* release the mutex lock */
-int worker_mutex_unlock(worker_mutex_t *mutex)
-{
-    __atomic_clear(&mutex->is_locked, __ATOMIC_SEQ_CST);
+    // - wait for a specific thread to terminate
+    // Park on its joiner list, worker_exit wakes us. Outside a worker
+    // there is nothing to park, so just poll.
+    spin_lock(&t->join_lock);
+    if (t->joined)
+    {
+        spin_unlock(&t->join_lock);
+        preempt_enable(self);
+        return EINVAL; // someone else is joining it
+    }
+    t->joined = 1;
+    if (t->status != THREAD_STATUS_FINISHED && self != NULL)
+    {
+        self->next = t->joiners;
+        t->joiners = self;
+        if (deadline != 0)
+        {
+            timer_init(&timer, self, &t->join_lock, t, &join_dequeue);
+            timer_add(&timer, deadline);
+        }
+        park(self, &t->join_lock);
+        if (deadline != 0 && timer_cancel(&timer))
+        {
+            preempt_enable(self);
+            return ETIMEDOUT; // join_dequeue() took us off, t may be joined again
+        }
+    }
+    else
+    {
+        spin_unlock(&t->join_lock);
+        while (__atomic_load_n(&t->status, __ATOMIC_ACQUIRE) != THREAD_STATUS_FINISHED)
+        {
+            if (deadline != 0 && now_ns() >= deadline)
+            {
+                spin_lock(&t->join_lock);
+                t->joined = 0;
+                spin_unlock(&t->join_lock);
+                preempt_enable(self);
+                return ETIMEDOUT;
+            }
+            sched_yield();
+        }
+    }
 
+    // - if value_ptr is provided, retrieve return value from joining thread
+    if (value_ptr != NULL)
+    {
+        *value_ptr = t->retval;
+    }
+    tcb_put(t);
+    preempt_enable(self);
     return 0;
-};
+}
 
-/* destroy the mutex */
-int worker_mutex_destroy(worker_mutex_t *mutex)
+/* initialize the mutex lock */
+int worker_mutex_init(worker_mutex_t *mutex,
+                      const pthread_mutexattr_t *mutexattr)
 {
-    __atomic_clear(&mutex->is_locked, __ATOMIC_SEQ_CST);
-
-    // - make sure mutex is not being used
-    // - de-allocate dynamic memory created in worker_mutex_init
-
+    //- initialize data structures for this mutex
+    // an all-zero mutex is unlocked with nobody waiting
+    memset(mutex, 0, sizeof(worker_mutex_t));
     return 0;
 };
 
-/* scheduler */
-static void schedule()
+/* aquire the mutex lock */
+int worker_mutex_lock(worker_mutex_t *mutex)
 {
-    // - every time a timer interrupt occurs, your worker thread library
-    // should be contexted switched from a thread context to this
-    // schedule() function
-
-    // - invoke scheduling algorithms according to the policy (RR or MLFQ)
-
-    // - schedule policy
-    pre_schedule();
+    return mutex_lock(mutex, 0);
+};
 
-#ifndef MLFQ
-    // Choose RR
-    sched_rr();
-#else
-    // Choose MLFQ
-    sched_mlfq();
+/* worker_mutex_lock, giving up with ETIMEDOUT at abstime on CLOCK_REALTIME
+ * like pthread_mutex_timedlock */
+int worker_mutex_timedlock(worker_mutex_t *mutex, const struct timespec *abstime)
+{
+    struct timespec now;
+    long long left;
 
-#endif
+    clock_gettime(CLOCK_REALTIME, &now);
+    left = (abstime->tv_sec - now.tv_sec) * 1000000000LL + (abstime->tv_nsec - now.tv_nsec);
+    return mutex_lock(mutex, now_ns() + (left > 0 ? left : 0));
 }
 
-static void sched_rr()
+/* Lock mutex, waiting until the monotonic deadline if it isn't 0 */
+static int mutex_lock(worker_mutex_t *mutex, unsigned long long deadline)
 {
-    // heart of program
-    tnode_t *temp_node;
-    tcb *t;
+    tcb *t = preempt_disable();
+    unsigned long long start = 0;
+    wtimer_t timer;
 
-    while (q.head != NULL)
+    while (!mutex_trylock(mutex, t))
     {
-        t = q.head->data;
-
-        if (t->status == THREAD_STATUS_FINISHED)
+        if (start == 0)
         {
-            dequeue(&q);
-            free(t);
+            start = now_ns(); // contended, start the clock
         }
-        else if (t->status == THREAD_STATUS_BLOCKED)
+        if (deadline != 0 && now_ns() >= deadline)
         {
-            if (is_running[t->yield_id] == 0)
-            {
-                t->status = THREAD_STATUS_READY;
-            }
-            dequeue(&q);
-            enqueue(t);
+            preempt_enable(t);
+            return ETIMEDOUT;
         }
-        else if (t->status == THREAD_STATUS_READY)
+
+        // A lock usually held briefly by a running owner is cheaper to
+        // spin on than to park for. mutex_spin() gives up once that stops
+        // paying off.
+        if (t != NULL && mutex_spin(mutex, start))
         {
-            t->status = THREAD_STATUS_RUNNING;
-            if (swapcontext(&sched_context, &t->context) < 0)
-            {
-                perror("swapcontext");
-                exit(1);
-            }
-            if (t->status == THREAD_STATUS_RUNNING)
-            {
-                t->status = THREAD_STATUS_READY;
-            }
-            dequeue(&q);
-            enqueue(t);
+            continue;
+        }
+        if (t == NULL)
+        {
+            // Not a worker, there is nothing to park: wait it out
+            sched_yield();
+            continue;
         }
-    }
 
-    free(sched_context.uc_stack.ss_sp); // empty stack
-    exit(0);
-}
+        spin_lock(&mutex->wait_lock);
+        if (!mutex->locked)
+        {
+            spin_unlock(&mutex->wait_lock);
+            continue;
+        }
 
-/* Preemptive MLFQ scheduling algorithm */
+        // Queue up and leave the CPU. The unlocker hands the mutex
+        // straight to us, so once we run again it is ours.
+        t->next = NULL;
+        if (mutex->wait_tail != NULL)
+        {
+            mutex->wait_tail->next = t;
+        }
+        else
+        {
+            __atomic_store_n(&mutex->wait_head, t, __ATOMIC_RELAXED);
+        }
+        mutex->wait_tail = t;
+        // an owner below our level would keep us waiting behind
+        // everything in between: lend it ours until it unlocks
+        mutex_lend(mutex, t, current_carrier());
+        if (deadline != 0)
+        {
+            timer_init(&timer, t, &mutex->wait_lock, mutex, &mutex_dequeue);
+            timer_add(&timer, deadline);
+        }
+        park(t, &mutex->wait_lock);
+        if (deadline != 0 && timer_cancel(&timer))
+        {
+            preempt_enable(t);
+            return ETIMEDOUT; // mutex_dequeue() took us off the queue
+        }
+        break;
+    }
 
-static void sched_mlfq()
-{
-    // Choose the thread from the highest-priority non-empty runqueue
-    int i;
-    for (i = 0; i < NUM_LEVELS; i++)
+    // Only the owner touches the counters, the mutex itself guards them
+    unsigned long long now = now_ns();
+    mutex->stats.acquisitions++;
+    if (start != 0)
     {
-        if (mlfq[i].size > 0)
-        {
-            tcb *t = mlfq_dequeue(i);
-            t->status = THREAD_STATUS_RUNNING;
+        mutex->stats.contended++;
+        mutex->stats.wait_ns += now - start;
+    }
+    mutex->acquired_at = now;
 
-            if (swapcontext(&sched_context, &t->context) < 0)
-            {
-                perror("swapcontext");
-                exit(1);
-            }
+    preempt_enable(t);
+    return 0;
+}
 
-            // Check if the thread used up its time quantum
-            if (t->status == THREAD_STATUS_RUNNING)
-            {
-                // Move the thread to a lower-priority queue
-                if (i < NUM_LEVELS - 1)
-                {
-                    mlfq_enqueue(t, i + 1);
-                }
-                else
-                {
-                    // If it was in the lowest-priority queue, keep it there
-                    mlfq_enqueue(t, i);
-                }
-            }
-            else
-            {
-                // The thread yielded or blocked, keep it in the same queue
-                mlfq_enqueue(t, i);
-            }
+/* take the mutex if it is free, else EBUSY */
+int worker_mutex_trylock(worker_mutex_t *mutex)
+{
+    tcb *t = preempt_disable();
 
-            break; // Only choose one thread from the highest-priority queue
-        }
+    if (!mutex_trylock(mutex, t))
+    {
+        preempt_enable(t);
+        return EBUSY;
     }
+    mutex->stats.acquisitions++;
+    mutex->acquired_at = now_ns();
+    preempt_enable(t);
+    return 0;
 }
 
-// Feel free to add any other functions you need.
-// You can also create separate files for helper functions, structures, etc.
-// But make sure that the Makefile is updated to account for the same.
-
-// HELPER FUNCTIONS HERE
+/* release the mutex lock */
+int worker_mutex_unlock(worker_mutex_t *mutex)
+{
+    // we only ran this high for the waiters, make way for them
+    if (mutex_unlock(mutex) && current_tcb() != NULL)
+    {
+        worker_yield();
+    }
+    return 0;
+};
 
-void enqueue(tcb *thread)
+/* Release mutex. Returns 1 when that took away the last level lent to
+ * its owner by mutex waiters. */
+static int mutex_unlock(worker_mutex_t *mutex)
 {
-    tnode_t *node = (tnode_t *)malloc(sizeof(tnode_t));
-    node->next = NULL;
-    node->data = thread;
+    tcb *self = preempt_disable();
+    tcb *t;
+    int unlent;
+
+    // - learn how long this lock is held, it sets the spin budget
+    long long hold = now_ns() - mutex->acquired_at;
+    if (hold > (long long)mutex->stats.max_hold_ns)
+    {
+        mutex->stats.max_hold_ns = hold;
+    }
+    mutex->avg_hold_ns += (hold - mutex->avg_hold_ns) / 8;
 
-    if (q.head == NULL)
+    // - hand the lock to the longest waiter, or release it if there is none.
+    //   A level waiters lent the owner goes with it: to the new owner if
+    //   the ones still waiting are above it.
+    spin_lock(&mutex->wait_lock);
+    unlent = mutex_unlend(mutex, mutex->owner);
+    t = mutex->wait_head;
+    if (t != NULL)
     {
-        q.head = node;
-        q.tail = node;
-        q.size = 1;
+        __atomic_store_n(&mutex->wait_head, t->next, __ATOMIC_RELAXED);
+        if (t->next == NULL)
+        {
+            mutex->wait_tail = NULL;
+        }
+        __atomic_store_n(&mutex->owner, t, __ATOMIC_RELAXED);
+        mutex_lend(mutex, t->next, NULL);
     }
     else
     {
-        q.tail->next = node;
-        q.tail = node;
-        q.size++;
+        __atomic_store_n(&mutex->owner, NULL, __ATOMIC_RELAXED);
+        __atomic_store_n(&mutex->locked, 0, __ATOMIC_RELAXED);
     }
-    return;
+    spin_unlock(&mutex->wait_lock);
+
+    if (t != NULL)
+    {
+        wake(t);
+    }
+    preempt_enable(self);
+    return unlent;
 }
 
-tcb *dequeue(q_t *q)
+/* copy out the contention counters of mutex. The owner updates them
+ * without locking, so a snapshot of a busy mutex may be slightly off. */
+int worker_mutex_stats(worker_mutex_t *mutex, worker_mutex_stats_t *stats)
 {
-    if (q->head == NULL)
-        return NULL; // queue must be empty
-
-    tnode_t *temp_node = q->head;
-    tcb *thread = temp_node->data;
-
-    q->head = q->head->next; // remove beginning node;
-    free(temp_node);
-    return thread;
+    *stats = mutex->stats;
+    return 0;
 }
 
-void timer_signal_handler(int signum)
+/* destroy the mutex */
+int worker_mutex_destroy(worker_mutex_t *mutex)
 {
-    ucontext_t curr_context;
-    getcontext(&curr_context);
-    if (curr_context.uc_stack.ss_sp != curr_context.uc_stack.ss_sp)
+    // - make sure mutex is not being used. No tick may switch us out
+    //   holding wait_lock: the next worker here could spin on it forever
+    tcb *self = preempt_disable();
+    spin_lock(&mutex->wait_lock);
+    if (mutex->locked || mutex->wait_head != NULL)
     {
-
-        if (swapcontext(&q.head->data->context, &sched_context) < 0)
-        {
-            perror("swapcontext");
-            exit(1);
-        }
+        spin_unlock(&mutex->wait_lock);
+        preempt_enable(self);
+        return EBUSY;
     }
-    return;
-}
+    spin_unlock(&mutex->wait_lock);
+    preempt_enable(self);
 
-void init_scheduler()
-{
-    getcontext(&sched_context);
-    sched_context.uc_stack.ss_sp = malloc(STACK_SIZE);
-    sched_context.uc_stack.ss_size = STACK_SIZE;
-    sched_context.uc_stack.ss_flags = 0;
-    sched_context.uc_link = 0;
-    makecontext(&sched_context, &schedule, 0);
-
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = &timer_signal_handler;
-    sigaction(SIGPROF, &sa, NULL);
+    // - de-allocate dynamic memory created in worker_mutex_init
+    // (none: the wait queue is threaded through the waiters' tcbs)
 
-    struct itimerval timer;
+    return 0;
+};
 
-    timer.it_interval.tv_usec = QUANTUM;
-    timer.it_interval.tv_sec = 0;
-    timer.it_value.tv_usec = QUANTUM;
-    timer.it_value.tv_sec = 0;
+/* initialize the condition variable */
+int worker_cond_init(worker_cond_t *cond, const pthread_condattr_t *attr)
+{
+    memset(cond, 0, sizeof(worker_cond_t));
+    return 0;
+}
 
-    // Set the timer up (start the timer)
-    setitimer(ITIMER_PROF, &timer, NULL);
+/* release mutex, wait for a signal and take mutex back */
+int worker_cond_wait(worker_cond_t *cond, worker_mutex_t *mutex)
+{
+    return cond_wait(cond, mutex, 0);
+}
 
-    tcb *starttcb = (tcb *)malloc(sizeof(tcb));
-    starttcb->thread_id = id++;
-    is_running[id] = 1;
-    starttcb->status = THREAD_STATUS_READY;
+/* worker_cond_wait, giving up with ETIMEDOUT at abstime on CLOCK_REALTIME */
+int worker_cond_timedwait(worker_cond_t *cond, worker_mutex_t *mutex,
+                          const struct timespec *abstime)
+{
+    struct timespec now;
+    long long left;
 
-    init_sched_finish = 1;
-    enqueue(starttcb);
+    clock_gettime(CLOCK_REALTIME, &now);
+    left = (abstime->tv_sec - now.tv_sec) * 1000000000LL + (abstime->tv_nsec - now.tv_nsec);
+    return cond_wait(cond, mutex, now_ns() + (left > 0 ? left : 1));
+}
 
-    swapcontext(&main_context, &sched_context);
+/* wake the longest waiter */
+int worker_cond_signal(worker_cond_t *cond)
+{
+    cond_release(cond, 0);
+    return 0;
+}
 
-    return;
+/* wake every waiter */
+int worker_cond_broadcast(worker_cond_t *cond)
+{
+    cond_release(cond, 1);
+    return 0;
 }
 
-ucontext_t create_start_worker_context(ucontext_t *uctx)
+/* destroy the condition variable, EBUSY while someone waits on it */
+int worker_cond_destroy(worker_cond_t *cond)
 {
-    ucontext_t context;
-    if (getcontext(&context) < 0)
-    {
-        perror("getContext err");
-        exit(1);
-    };
-    void *stack = malloc(STACK_SIZE);
-    context.uc_link = NULL;
-    context.uc_stack.ss_sp = stack;
-    context.uc_stack.ss_size = STACK_SIZE;
-    context.uc_stack.ss_flags = 0;
-    makecontext(&context, (void *)&start_worker, 1, uctx);
-    return context;
+    return __atomic_load_n(&cond->wait_head, __ATOMIC_RELAXED) != NULL ? EBUSY : 0;
 }
 
-void start_worker(ucontext_t *ctx)
+/* initialize the semaphore with value units */
+int worker_sem_init(worker_sem_t *sem, unsigned int value)
 {
-    if (ctx == NULL)
+    if (value > INT_MAX)
     {
-        return;
+        return EINVAL;
     }
-    setcontext(ctx);
-
-    // on failure we will free all the data
-    free(ctx->uc_stack.ss_sp);
-    free(ctx);
-    worker_exit(NULL);
-    return;
+    memset(sem, 0, sizeof(worker_sem_t));
+    sem->value = value;
+    return 0;
 }
 
-void pre_schedule()
+/* take a unit, parking until one is posted */
+int worker_sem_wait(worker_sem_t *sem)
 {
-    tnode_t *temp = q.head;
+    tcb *self = preempt_disable();
 
-    while (temp != NULL)
+    spin_lock(&sem->lock);
+    while (sem->value == 0 && self == NULL)
     {
-        if (temp->data->thread_id != 1)
+        // Not a worker, there is nothing to park: wait it out
+        spin_unlock(&sem->lock);
+        sched_yield();
+        spin_lock(&sem->lock);
+    }
+    if (sem->value > 0)
+    {
+        sem->value--;
+        spin_unlock(&sem->lock);
+        preempt_enable(self);
+        return 0;
+    }
+
+    // worker_sem_post hands its unit straight to us
+    self->next = NULL;
+    if (sem->wait_tail != NULL)
+    {
+        sem->wait_tail->next = self;
+    }
+    else
+    {
+        sem->wait_head = self;
+    }
+    sem->wait_tail = self;
+    park(self, &sem->lock);
+    preempt_enable(self);
+    return 0;
+}
+
+/* take a unit if there is one, else EAGAIN */
+int worker_sem_trywait(worker_sem_t *sem)
+{
+    tcb *self = preempt_disable();
+    int ret = EAGAIN;
+
+    spin_lock(&sem->lock);
+    if (sem->value > 0)
+    {
+        sem->value--;
+        ret = 0;
+    }
+    spin_unlock(&sem->lock);
+    preempt_enable(self);
+    return ret;
+}
+
+/* give a unit back, to the longest waiter if there is one */
+int worker_sem_post(worker_sem_t *sem)
+{
+    tcb *self = preempt_disable();
+    tcb *t;
+
+    spin_lock(&sem->lock);
+    t = sem->wait_head;
+    if (t != NULL)
+    {
+        sem->wait_head = t->next;
+        if (t->next == NULL)
+        {
+            sem->wait_tail = NULL;
+        }
+    }
+    else if (sem->value == INT_MAX)
+    {
+        spin_unlock(&sem->lock);
+        preempt_enable(self);
+        return EOVERFLOW;
+    }
+    else
+    {
+        sem->value++;
+    }
+    spin_unlock(&sem->lock);
+
+    if (t != NULL)
+    {
+        wake(t);
+    }
+    preempt_enable(self);
+    return 0;
+}
+
+/* units left, 0 while threads wait */
+int worker_sem_getvalue(worker_sem_t *sem, int *value)
+{
+    *value = __atomic_load_n(&sem->value, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* destroy the semaphore, EBUSY while someone waits on it */
+int worker_sem_destroy(worker_sem_t *sem)
+{
+    return __atomic_load_n(&sem->wait_head, __ATOMIC_RELAXED) != NULL ? EBUSY : 0;
+}
+
+/* initialize the barrier for rounds of count threads */
+int worker_barrier_init(worker_barrier_t *barrier, unsigned int count)
+{
+    if (count == 0)
+    {
+        return EINVAL;
+    }
+    memset(barrier, 0, sizeof(worker_barrier_t));
+    barrier->count = count;
+    return 0;
+}
+
+/* Wait until count threads are here. The last one to arrive wakes the
+ * rest in one batch and gets WORKER_BARRIER_SERIAL_THREAD. */
+int worker_barrier_wait(worker_barrier_t *barrier)
+{
+    tcb *self = preempt_disable();
+    tcb *waiters;
+    unsigned int round;
+
+    spin_lock(&barrier->lock);
+    if (++barrier->waiting == barrier->count)
+    {
+        waiters = barrier->waiters;
+        barrier->waiters = NULL;
+        barrier->waiting = 0;
+        __atomic_add_fetch(&barrier->round, 1, __ATOMIC_RELEASE);
+        spin_unlock(&barrier->lock);
+        wake_all(waiters);
+        preempt_enable(self);
+        return WORKER_BARRIER_SERIAL_THREAD;
+    }
+
+    if (self == NULL)
+    {
+        // Not a worker, there is nothing to park: wait for the round to end
+        round = barrier->round;
+        spin_unlock(&barrier->lock);
+        while (__atomic_load_n(&barrier->round, __ATOMIC_ACQUIRE) == round)
+        {
+            sched_yield();
+        }
+        return 0;
+    }
+    self->next = barrier->waiters;
+    barrier->waiters = self;
+    park(self, &barrier->lock);
+    preempt_enable(self);
+    return 0;
+}
+
+/* destroy the barrier, EBUSY in the middle of a round */
+int worker_barrier_destroy(worker_barrier_t *barrier)
+{
+    return __atomic_load_n(&barrier->waiting, __ATOMIC_RELAXED) != 0 ? EBUSY : 0;
+}
+
+/* initialize the reader-writer lock */
+int worker_rwlock_init(worker_rwlock_t *rwlock, const pthread_rwlockattr_t *attr)
+{
+    memset(rwlock, 0, sizeof(worker_rwlock_t));
+    return 0;
+}
+
+/* take the lock shared, parking while a writer holds it or waits for it */
+int worker_rwlock_rdlock(worker_rwlock_t *rwlock)
+{
+    tcb *self = preempt_disable();
+
+    spin_lock(&rwlock->lock);
+    while ((rwlock->writer || rwlock->write_head != NULL) && self == NULL)
+    {
+        // Not a worker, there is nothing to park: wait it out
+        spin_unlock(&rwlock->lock);
+        sched_yield();
+        spin_lock(&rwlock->lock);
+    }
+    if (!rwlock->writer && rwlock->write_head == NULL)
+    {
+        rwlock->readers++;
+        spin_unlock(&rwlock->lock);
+        preempt_enable(self);
+        return 0;
+    }
+
+    // worker_rwlock_unlock counts us in before waking us
+    self->next = rwlock->read_waiters;
+    rwlock->read_waiters = self;
+    park(self, &rwlock->lock);
+    preempt_enable(self);
+    return 0;
+}
+
+/* take the lock shared if that needs no waiting, else EBUSY */
+int worker_rwlock_tryrdlock(worker_rwlock_t *rwlock)
+{
+    tcb *self = preempt_disable();
+    int ret = EBUSY;
+
+    spin_lock(&rwlock->lock);
+    if (!rwlock->writer && rwlock->write_head == NULL)
+    {
+        rwlock->readers++;
+        ret = 0;
+    }
+    spin_unlock(&rwlock->lock);
+    preempt_enable(self);
+    return ret;
+}
+
+/* take the lock exclusively, parking until readers and writers are gone */
+int worker_rwlock_wrlock(worker_rwlock_t *rwlock)
+{
+    tcb *self = preempt_disable();
+
+    spin_lock(&rwlock->lock);
+    while ((rwlock->writer || rwlock->readers > 0) && self == NULL)
+    {
+        // Not a worker, there is nothing to park: wait it out
+        spin_unlock(&rwlock->lock);
+        sched_yield();
+        spin_lock(&rwlock->lock);
+    }
+    if (!rwlock->writer && rwlock->readers == 0)
+    {
+        rwlock->writer = 1;
+        spin_unlock(&rwlock->lock);
+        preempt_enable(self);
+        return 0;
+    }
+
+    // worker_rwlock_unlock makes us the writer before waking us
+    self->next = NULL;
+    if (rwlock->write_tail != NULL)
+    {
+        rwlock->write_tail->next = self;
+    }
+    else
+    {
+        rwlock->write_head = self;
+    }
+    rwlock->write_tail = self;
+    park(self, &rwlock->lock);
+    preempt_enable(self);
+    return 0;
+}
+
+/* take the lock exclusively if that needs no waiting, else EBUSY */
+int worker_rwlock_trywrlock(worker_rwlock_t *rwlock)
+{
+    tcb *self = preempt_disable();
+    int ret = EBUSY;
+
+    spin_lock(&rwlock->lock);
+    if (!rwlock->writer && rwlock->readers == 0)
+    {
+        rwlock->writer = 1;
+        ret = 0;
+    }
+    spin_unlock(&rwlock->lock);
+    preempt_enable(self);
+    return ret;
+}
+
+/* Drop a shared or the exclusive hold. When the lock comes free a
+ * writer leaving lets all waiting readers in at once, otherwise the next
+ * writer gets it. */
+int worker_rwlock_unlock(worker_rwlock_t *rwlock)
+{
+    tcb *self = preempt_disable();
+    tcb *readers = NULL, *writer = NULL;
+    int was_writer;
+
+    spin_lock(&rwlock->lock);
+    was_writer = rwlock->writer;
+    if (was_writer)
+    {
+        rwlock->writer = 0;
+    }
+    else
+    {
+        rwlock->readers--;
+    }
+
+    if (rwlock->readers == 0)
+    {
+        if (rwlock->read_waiters != NULL && (was_writer || rwlock->write_head == NULL))
+        {
+            readers = rwlock->read_waiters;
+            rwlock->read_waiters = NULL;
+            for (tcb *t = readers; t != NULL; t = t->next)
+            {
+                rwlock->readers++;
+            }
+        }
+        else if (rwlock->write_head != NULL)
+        {
+            writer = rwlock->write_head;
+            rwlock->write_head = writer->next;
+            if (writer->next == NULL)
+            {
+                rwlock->write_tail = NULL;
+            }
+            rwlock->writer = 1;
+        }
+    }
+    spin_unlock(&rwlock->lock);
+
+    if (writer != NULL)
+    {
+        wake(writer);
+    }
+    wake_all(readers);
+    preempt_enable(self);
+    return 0;
+}
+
+/* destroy the reader-writer lock, EBUSY while held */
+int worker_rwlock_destroy(worker_rwlock_t *rwlock)
+{
+    return __atomic_load_n(&rwlock->readers, __ATOMIC_RELAXED) != 0 ||
+                   __atomic_load_n(&rwlock->writer, __ATOMIC_RELAXED) != 0
+               ? EBUSY
+               : 0;
+}
+
+/* start an empty task group */
+int worker_task_group_init(worker_task_group_t *group)
+{
+    memset(group, 0, sizeof(worker_task_group_t));
+    return 0;
+}
+
+/* run function(arg) as a task of group, on the task pool */
+int worker_task_group_run(worker_task_group_t *group, void (*function)(void *), void *arg)
+{
+    task_t *task = (task_t *)worker_malloc(sizeof(task_t));
+
+    if (task == NULL)
+    {
+        return ENOMEM;
+    }
+    task->function = function;
+    task->arg = arg;
+    task->heap = 1;
+    task_spawn(task, group);
+    return 0;
+}
+
+/* wait until every task of group has finished, running tasks meanwhile */
+int worker_task_group_wait(worker_task_group_t *group)
+{
+    task_wait(group);
+    return 0;
+}
+
+/* destroy the task group, EBUSY while it has unfinished tasks */
+int worker_task_group_destroy(worker_task_group_t *group)
+{
+    return __atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) != 0 ? EBUSY : 0;
+}
+
+/* Call function on pieces of [begin, end) of at most grain indexes, in
+ * parallel on the task pool, and return once they are all done */
+int worker_parallel_for(long begin, long end, long grain,
+                        void (*function)(long begin, long end, void *arg), void *arg)
+{
+    for_range_t range;
+
+    if (end <= begin)
+    {
+        return 0;
+    }
+    if (init_sched_finish == 0)
+    {
+        init_scheduler();
+    }
+    if (grain < 1)
+    {
+        // enough pieces to go round, and to even out uneven ones
+        grain = (end - begin) / (FOR_PIECES * num_carriers);
+        grain = grain > 0 ? grain : 1;
+    }
+    range.begin = begin;
+    range.end = end;
+    range.grain = grain;
+    range.function = function;
+    range.arg = arg;
+    for_run(&range);
+    return 0;
+}
+
+/* Set up a channel of capacity values of elem_size bytes each. Capacity
+ * 0 makes every send wait for the receiver that takes it. */
+int worker_chan_init(worker_chan_t *chan, size_t elem_size, unsigned int capacity)
+{
+    if (elem_size == 0)
+    {
+        return EINVAL;
+    }
+    memset(chan, 0, sizeof(worker_chan_t));
+    chan->elem_size = elem_size;
+    chan->capacity = capacity;
+    if (capacity > 0)
+    {
+        chan->buf = (char *)worker_malloc((size_t)capacity * elem_size);
+        if (chan->buf == NULL)
+        {
+            return ENOMEM;
+        }
+    }
+    return 0;
+}
+
+/* send the value at elem, waiting while the channel is full; EPIPE once
+ * it is closed */
+int worker_chan_send(worker_chan_t *chan, const void *elem)
+{
+    worker_chan_case_t c = {chan, WORKER_CHAN_SEND, (void *)elem};
+    int chosen;
+    return chan_select(&c, 1, &chosen, 1);
+}
+
+/* worker_chan_send, or EAGAIN instead of waiting */
+int worker_chan_trysend(worker_chan_t *chan, const void *elem)
+{
+    worker_chan_case_t c = {chan, WORKER_CHAN_SEND, (void *)elem};
+    int chosen;
+    return chan_select(&c, 1, &chosen, 0);
+}
+
+/* receive a value into elem, waiting while the channel is empty; EPIPE,
+ * and elem zeroed, once it is closed and drained */
+int worker_chan_recv(worker_chan_t *chan, void *elem)
+{
+    worker_chan_case_t c = {chan, WORKER_CHAN_RECV, elem};
+    int chosen;
+    return chan_select(&c, 1, &chosen, 1);
+}
+
+/* worker_chan_recv, or EAGAIN instead of waiting */
+int worker_chan_tryrecv(worker_chan_t *chan, void *elem)
+{
+    worker_chan_case_t c = {chan, WORKER_CHAN_RECV, elem};
+    int chosen;
+    return chan_select(&c, 1, &chosen, 0);
+}
+
+/* Wait until one of the cases can go through and do it, picking at random
+ * among those ready at once. *chosen is its index; the result is that of
+ * its send or receive. */
+int worker_chan_select(worker_chan_case_t *cases, int ncases, int *chosen)
+{
+    return chan_select(cases, ncases, chosen, 1);
+}
+
+/* worker_chan_select, or EAGAIN instead of waiting */
+int worker_chan_tryselect(worker_chan_case_t *cases, int ncases, int *chosen)
+{
+    return chan_select(cases, ncases, chosen, 0);
+}
+
+/* Close the channel: waiting senders and every later send fail with
+ * EPIPE, receivers drain what is left and then get EPIPE too */
+int worker_chan_close(worker_chan_t *chan)
+{
+    tcb *self = preempt_disable();
+    chan_waiter_t *w, *list = NULL;
+    tcb *t, *woken = NULL;
+
+    spin_lock(&chan->lock);
+    if (chan->closed)
+    {
+        spin_unlock(&chan->lock);
+        preempt_enable(self);
+        return EPIPE;
+    }
+    chan->closed = 1;
+    while ((w = chan_claim(&chan->send_head, &chan->send_tail)) != NULL)
+    {
+        w->wait->status = EPIPE;
+        w->next = list;
+        list = w;
+    }
+    // the buffer is empty if anybody waits to receive
+    while ((w = chan_claim(&chan->recv_head, &chan->recv_tail)) != NULL)
+    {
+        if (w->elem != NULL)
+        {
+            memset(w->elem, 0, chan->elem_size);
+        }
+        w->wait->status = EPIPE;
+        w->next = list;
+        list = w;
+    }
+    spin_unlock(&chan->lock);
+
+    while ((w = list) != NULL)
+    {
+        list = w->next;
+        if ((t = chan_wake(w->wait)) != NULL)
+        {
+            t->next = woken;
+            woken = t;
+        }
+    }
+    wake_all(woken);
+    preempt_enable(self);
+    return 0;
+}
+
+/* destroy the channel, EBUSY while anybody waits on it */
+int worker_chan_destroy(worker_chan_t *chan)
+{
+    if (__atomic_load_n(&chan->send_head, __ATOMIC_RELAXED) != NULL ||
+        __atomic_load_n(&chan->recv_head, __ATOMIC_RELAXED) != NULL)
+    {
+        return EBUSY;
+    }
+    worker_free(chan->buf);
+    chan->buf = NULL;
+    return 0;
+}
+
+/* Allocate size bytes, 16-byte aligned. Unlike malloc() this is safe
+ * from a worker that may be preempted at any time: the timer is held off
+ * while we are in here, and each carrier takes from its own heap without
+ * a lock. Sizes above 8 kB get a mapping of their own. NULL when out of
+ * memory. */
+void *worker_malloc(size_t size)
+{
+    tcb *self;
+    heap_t *heap;
+    void *p;
+    int cls;
+
+    if (size > (size_t)HEAP_MIN << (HEAP_CLASSES - 1))
+    {
+        return heap_big(size);
+    }
+    cls = heap_class(size);
+    self = preempt_disable();
+    heap = heap_enter();
+    p = heap->free[cls];
+    if (p != NULL)
+    {
+        heap->free[cls] = *(void **)p;
+    }
+    else
+    {
+        p = heap_refill(heap, cls);
+    }
+    heap_leave(heap);
+    preempt_enable(self);
+    return p;
+}
+
+/* Give back memory from worker_malloc, on any thread. An object freed
+ * on another carrier than the one it came from is queued for that one
+ * to take back next time it runs short. */
+void worker_free(void *ptr)
+{
+    heap_slab_t *slab;
+    carrier_t *c;
+    tcb *self;
+    void *head;
+
+    if (ptr == NULL)
+    {
+        return;
+    }
+    slab = heap_slab(ptr);
+    if (slab->heap == NULL)
+    {
+        munmap(slab, slab->size);
+        return;
+    }
+
+    self = preempt_disable();
+    c = current_carrier();
+    if (c != NULL && slab->heap == &c->heap)
+    {
+        *(void **)ptr = c->heap.free[slab->cls];
+        c->heap.free[slab->cls] = ptr;
+    }
+    else if (slab->heap == &shared_heap)
+    {
+        spin_lock(&shared_heap.lock);
+        *(void **)ptr = shared_heap.free[slab->cls];
+        shared_heap.free[slab->cls] = ptr;
+        spin_unlock(&shared_heap.lock);
+    }
+    else
+    {
+        head = __atomic_load_n(&slab->heap->remote, __ATOMIC_RELAXED);
+        do
+        {
+            *(void **)ptr = head;
+        } while (!__atomic_compare_exchange_n(&slab->heap->remote, &head, ptr, 1,
+                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    preempt_enable(self);
+}
+
+/* park the calling worker for ns nanoseconds */
+int worker_sleep_ns(unsigned long long ns)
+{
+    tcb *self = preempt_disable();
+    atomic_flag lock = ATOMIC_FLAG_INIT;
+    struct timespec ts;
+    wtimer_t timer;
+
+    if (self == NULL)
+    {
+        // outside a worker only this kernel thread has to wait
+        ts.tv_sec = ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        {
+        }
+        return 0;
+    }
+    if (ns == 0)
+    {
+        preempt_enable(self);
+        return worker_yield();
+    }
+
+    // nothing else can wake us, so the timer always fires
+    spin_lock(&lock);
+    timer_init(&timer, self, &lock, NULL, &sleep_dequeue);
+    timer_add(&timer, now_ns() + ns);
+    park(self, &lock);
+    timer_cancel(&timer);
+    preempt_enable(self);
+    return 0;
+}
+
+/* wait for events on fds, like poll(2), parking only the calling worker */
+int worker_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    io_waiter_t local[IO_LOCAL], *nodes = local;
+    unsigned long long deadline = 0;
+    io_wait_t wait;
+    wtimer_t timer;
+    int n, k, i, expired = 0;
+    tcb *self;
+
+    // Already ready, or nothing to park: outside a worker the kernel waits
+    n = io_probe(fds, nfds);
+    if (n != 0 || timeout == 0)
+    {
+        return n;
+    }
+    if (current_tcb() == NULL)
+    {
+        return poll(fds, nfds, timeout);
+    }
+
+    // one watch per fd; the timeout is a timer in the wheel
+    if (nfds > IO_LOCAL && (nodes = worker_malloc(nfds * sizeof(io_waiter_t))) == NULL)
+    {
+        errno = ENOMEM; // like poll(2)
+        return -1;
+    }
+    if (timeout > 0)
+    {
+        deadline = now_ns() + timeout * 1000000ULL;
+    }
+
+    for (;;)
+    {
+        self = preempt_disable();
+        wait.t = self;
+        wait.fired = 0;
+        atomic_flag_clear(&wait.lock);
+        spin_lock(&wait.lock);
+
+        // register everything before parking: an fd that fires meanwhile
+        // waits on wait.lock until we are off the CPU
+        for (i = 0, k = 0; i < (int)nfds && n >= 0; i++)
+        {
+            unsigned int events = fds[i].events & (POLLIN | POLLPRI | POLLOUT | POLLRDHUP);
+            if (fds[i].fd >= 0 && io_watch(&nodes[k], &wait, fds[i].fd, events) == 0)
+            {
+                k++;
+            }
+            else if (fds[i].fd >= 0)
+            {
+                n = -1;
+            }
+        }
+
+        if (n >= 0)
+        {
+            // the timer races the fds for wait.fired, see poll_dequeue()
+            if (deadline != 0)
+            {
+                timer_init(&timer, self, &wait.lock, &wait, &poll_dequeue);
+                timer_add(&timer, deadline);
+            }
+            __atomic_add_fetch(&io_waiting, 1, __ATOMIC_SEQ_CST);
+            // with nobody in epoll_wait, get an idle carrier to sit there
+            if (!__atomic_load_n(&polling, __ATOMIC_SEQ_CST) &&
+                __atomic_load_n(&nr_idle, __ATOMIC_SEQ_CST) > 0)
+            {
+                syscall(SYS_futex, &work_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+            }
+            park(self, &wait.lock);
+            __atomic_sub_fetch(&io_waiting, 1, __ATOMIC_SEQ_CST);
+            expired = deadline != 0 && timer_cancel(&timer);
+        }
+        else
+        {
+            // epoll won't take one of the fds: nobody can wake us
+            __atomic_store_n(&wait.fired, 1, __ATOMIC_RELAXED);
+            spin_unlock(&wait.lock);
+        }
+        while (k-- > 0)
+        {
+            io_unwatch(&nodes[k]);
+        }
+        preempt_enable(self);
+
+        if (n < 0)
+        {
+            // let the kernel wait, the timeout may start over
+            n = poll(fds, nfds, timeout);
+            break;
+        }
+        n = io_probe(fds, nfds);
+        if (n != 0 || expired)
+        {
+            break;
+        }
+    }
+
+    if (nodes != local)
+    {
+        worker_free(nodes);
+    }
+    return n;
+}
+
+/* read(2) that parks the calling worker until fd is readable */
+ssize_t worker_read(int fd, void *buf, size_t count)
+{
+    struct pollfd p = {fd, POLLIN, 0};
+    ssize_t n;
+
+    io_nonblock(fd);
+    while ((n = read(fd, buf, count)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        if (errno != EINTR && worker_poll(&p, 1, -1) < 0)
+        {
+            return -1;
+        }
+    }
+    return n;
+}
+
+/* write(2) that parks the calling worker until fd is writable */
+ssize_t worker_write(int fd, const void *buf, size_t count)
+{
+    struct pollfd p = {fd, POLLOUT, 0};
+    ssize_t n;
+
+    io_nonblock(fd);
+    while ((n = write(fd, buf, count)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        if (errno != EINTR && worker_poll(&p, 1, -1) < 0)
+        {
+            return -1;
+        }
+    }
+    return n;
+}
+
+/* accept(2) that parks the calling worker until a connection comes in */
+int worker_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    struct pollfd p = {fd, POLLIN, 0};
+    int n;
+
+    io_nonblock(fd);
+    while ((n = accept(fd, addr, addrlen)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        if (errno != EINTR && worker_poll(&p, 1, -1) < 0)
+        {
+            return -1;
+        }
+    }
+    return n;
+}
+
+/* The calling worker is about to block in the kernel, in a system call
+ * the runtime can't park it for. It moves to a spare kernel thread
+ * until worker_blocking_end(), so the rest of its carrier's queue keeps
+ * running meanwhile. In between it is outside the carriers, like any
+ * other thread: it should block and come back, not exit or wait on
+ * other workers. */
+int worker_blocking_begin()
+{
+    tcb *t;
+    int spawn = 0;
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if ((t = preempt_disable()) == NULL)
+    {
+        return 0; // not a worker: there is no carrier to stall
+    }
+
+    spin_lock(&blocking_lock);
+    if (spare_idle == 0 && spare_threads < SPARE_MAX)
+    {
+        spare_threads++;
+        spawn = 1;
+    }
+    spin_unlock(&blocking_lock);
+    if (spawn)
+    {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        spawn = carrier_spawn(&thread, &attr, &spare_main, NULL) == 0;
+        pthread_attr_destroy(&attr);
+        if (!spawn)
+        {
+            // the spares we have will get to it, if there are any
+            spin_lock(&blocking_lock);
+            spawn = --spare_threads > 0;
+            spin_unlock(&blocking_lock);
+            if (!spawn)
+            {
+                // nobody would ever run us again: block on the carrier
+                preempt_enable(t);
+                return EAGAIN;
+            }
+        }
+    }
+
+    spin_lock(&blocking_lock);
+    t->next = NULL;
+    if (blocking_tail != NULL)
+    {
+        blocking_tail->next = t;
+    }
+    else
+    {
+        blocking_head = t;
+    }
+    blocking_tail = t;
+    __atomic_add_fetch(&spare_seq, 1, __ATOMIC_SEQ_CST);
+    if (spare_idle > 0)
+    {
+        syscall(SYS_futex, &spare_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+    // a spare can only take us once our context is saved
+    park(t, &blocking_lock);
+    return 0;
+}
+
+/* Back from blocking: give the spare kernel thread up and wait for a
+ * carrier to run us again */
+int worker_blocking_end()
+{
+    tcb *t = spare_tcb;
+
+    if (t == NULL)
+    {
+        return 0; // worker_blocking_begin() did not hand us off, or failed
+    }
+    spare_tcb = NULL;
+    ctx_switch(&t->context, &spare_context);
+
+    // on a carrier again, resumed like in switch_from()
+    finish_switch(current_carrier());
+    preempt_enable(t);
+    return 0;
+}
+
+/* where thread's time went so far */
+int worker_stats(worker_t thread, worker_stats_t *stats)
+{
+    tcb *t = tcb_lookup(thread);
+    unsigned long long now = trace_clock();
+    unsigned long long since;
+
+    if (t == NULL)
+    {
+        return ESRCH;
+    }
+
+    memset(stats, 0, sizeof(worker_stats_t));
+    stats->run_ns = t->run_time;
+    stats->ready_ns = t->ready_time;
+    stats->blocked_ns = t->blocked_time;
+    stats->switches = t->switches;
+    if (t->first_run_at != 0)
+    {
+        stats->response_ns = ticks_to_ns(t->first_run_at - t->created_at);
+    }
+
+    // count the time since its last event too
+    since = now > t->state_since ? now - t->state_since : 0;
+    switch (t->trace_state)
+    {
+    case TRACE_EXIT:
+        stats->turnaround_ns = ticks_to_ns(t->state_since - t->created_at);
+        break;
+    case TRACE_SWITCH_IN:
+        stats->run_ns += since;
+        break;
+    case TRACE_BLOCK:
+        stats->blocked_ns += since;
+        break;
+    default:
+        stats->ready_ns += since;
+        break;
+    }
+    if (stack_debug && t->stack != NULL)
+    {
+        stats->stack_peak = t->trace_state == TRACE_EXIT ? t->stack_peak : stack_peak(t);
+    }
+    stats->run_ns = ticks_to_ns(stats->run_ns);
+    stats->ready_ns = ticks_to_ns(stats->ready_ns);
+    stats->blocked_ns = ticks_to_ns(stats->blocked_ns);
+    return 0;
+}
+
+/* Write the trace ring to path as Chrome trace JSON, then print where the
+ * finished threads' time went on average */
+int worker_trace_dump(const char *path)
+{
+    unsigned long n = __atomic_load_n(&done_threads, __ATOMIC_RELAXED);
+    FILE *f;
+
+    if (path != NULL)
+    {
+        f = fopen(path, "w");
+        if (f == NULL)
+        {
+            return errno;
+        }
+        trace_write(f);
+        fclose(f);
+    }
+
+    printf("%-6s %8s %14s %14s %12s %12s %12s %9s\n", "policy", "threads", "turnaround ms",
+           "response ms", "run ms", "ready ms", "blocked ms", "switches");
+    if (n == 0)
+    {
+        printf("%-6s %8d %14s %14s %12s %12s %12s %9s\n", POLICY_NAME, 0, "-", "-", "-", "-", "-", "-");
+        return 0;
+    }
+    printf("%-6s %8lu %14.3f %14.3f %12.3f %12.3f %12.3f %9.1f\n", POLICY_NAME, n,
+           ticks_to_ns(done_turnaround) / 1e6 / n, ticks_to_ns(done_response) / 1e6 / n,
+           ticks_to_ns(done_run) / 1e6 / n, ticks_to_ns(done_ready) / 1e6 / n,
+           ticks_to_ns(done_blocked) / 1e6 / n, (double)done_switches / n);
+    return 0;
+}
+
+/* scheduler */
+static void schedule()
+{
+    // - every time a timer interrupt occurs, your worker thread library
+    // should be contexted switched from a thread context to this
+    // schedule() function
+
+    // - invoke scheduling algorithms according to the policy (RR or MLFQ)
+
+    // Each carrier runs this loop forever over its own run queue.
+    carrier_t *c = current_carrier();
+    unsigned long long deadline, now;
+    long long timeout;
+    unsigned int seq;
+    tcb *t;
+
+    c->tid = syscall(SYS_gettid);
+    c->kthread = pthread_self();
+
+    // Create this carrier's preemption timer. It counts the CPU time of
+    // this kernel thread only and its SIGPROF is delivered to this thread
+    // only. CPU-time timers only fire on the kernel's own tick, which is
+    // too coarse for CFS: it uses a wall-clock timer. Either way it is a
+    // one-shot deadline, armed by arm_slice() only when someone waits.
+    if (!cooperative)
+    {
+        struct sigevent sev;
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = SIGPROF;
+        sev.sigev_notify_thread_id = c->tid;
+#ifdef CFS
+        if (timer_create(CLOCK_MONOTONIC, &sev, &c->timer) < 0)
+#else
+        if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &c->timer) < 0)
+#endif
+        {
+            perror("timer_create");
+            exit(1);
+        }
+    }
+
+    for (;;)
+    {
+        // sample before looking at the queues so new work can't slip by
+        seq = __atomic_load_n(&work_seq, __ATOMIC_SEQ_CST);
+#if defined(MLFQ) || defined(CFS)
+        c->clock = now_ns();
+#endif
+
+        // - schedule policy
+        t = pick_next(c);
+
+        if (t == NULL)
+        {
+            // Nothing runnable anywhere: sleep until new work is published.
+            reap_dead(c);
+            if (__atomic_exchange_n(&c->armed_level, 0, __ATOMIC_RELAXED) != 0)
+            {
+                // nobody left to preempt for: don't wake up for nothing
+                struct itimerspec stop = {{0, 0}, {0, 0}};
+                timer_settime(c->timer, 0, &stop, NULL);
+            }
+            __atomic_add_fetch(&nr_idle, 1, __ATOMIC_SEQ_CST);
+
+            // Sleep no longer than until the next timer is due. One added
+            // meanwhile wakes us if it is due sooner, see timer_add().
+            __atomic_store_n(&idle_deadline, 0, __ATOMIC_SEQ_CST);
+            deadline = timer_next();
+            __atomic_store_n(&idle_deadline, deadline != 0 ? deadline : ~0ULL, __ATOMIC_SEQ_CST);
+            timeout = -1;
+            if (deadline != 0)
+            {
+                now = now_ns();
+                timeout = deadline > now ? deadline - now : 0;
+            }
+
+            if (__atomic_load_n(&io_waiting, __ATOMIC_SEQ_CST) > 0 &&
+                !__atomic_exchange_n(&polling, 1, __ATOMIC_SEQ_CST))
+            {
+                // Workers are parked on I/O: wait for it in epoll instead.
+                // make_ready() writes wake_fd if it finds only us idle.
+                if (__atomic_load_n(&work_seq, __ATOMIC_SEQ_CST) == seq)
+                {
+                    io_poll(c, timeout);
+                }
+                __atomic_store_n(&polling, 0, __ATOMIC_SEQ_CST);
+            }
+            else if (timeout != 0)
+            {
+                struct timespec ts = {timeout / 1000000000, timeout % 1000000000};
+                syscall(SYS_futex, &work_seq, FUTEX_WAIT_PRIVATE, seq,
+                        timeout > 0 ? &ts : NULL, NULL, 0);
+            }
+            __atomic_sub_fetch(&nr_idle, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        t->status = THREAD_STATUS_RUNNING;
+        trace(t, TRACE_SWITCH_IN, trace_clock());
+        c->current = t;
+        c->prev = NULL;
+        self_tcb = t;
+        ctx_switch(&c->sched_context, &t->context);
+
+        // Workers switch to each other directly; we only get back here when
+        // one left the CPU with nothing else runnable. Requeue it.
+        finish_switch(c);
+    }
+}
+
+/* next thread for c under the configured policy */
+static tcb *pick_next(carrier_t *c)
+{
+    tcb *t;
+    int retry = 1;
+
+    // now and then, and whenever nothing else is runnable, reap I/O
+    if (c->ticks % 64 == 63)
+    {
+        io_poll(c, 0);
+    }
+    // Wake whoever timed out. Not while the thread leaving is parking: a
+    // timeout may need the very wait queue lock it still holds.
+    if (c->prev_lock == NULL)
+    {
+        timer_run();
+    }
+    do
+    {
+#if defined(MLFQ)
+        // Choose MLFQ
+        t = sched_mlfq(c);
+#elif defined(CFS)
+        // Choose CFS
+        t = sched_cfs(c);
+#else
+        // Choose RR
+        t = sched_rr(c);
+#endif
+    } while (t == NULL && retry-- && io_poll(c, 0) > 0);
+    return t;
+}
+
+#if !defined(MLFQ) && !defined(CFS)
+static tcb *sched_rr(carrier_t *c)
+{
+    // heart of program
+    return find_work(c, 1);
+}
+#endif
+
+#ifdef MLFQ
+/* Preemptive MLFQ scheduling algorithm */
+
+static tcb *sched_mlfq(carrier_t *c)
+{
+    unsigned int epoch = c->clock / (BOOST_PERIOD * 1000ULL);
+    tcb *t;
+
+    // Priority boost: the first time this carrier looks after a boost
+    // period ends, everything queued on its lower levels goes to the top.
+    // Threads anywhere else catch up when they are next picked.
+    if (epoch != c->boost_epoch)
+    {
+        c->boost_epoch = epoch;
+        boost(c, epoch);
+    }
+
+    // Choose the thread from the highest-priority non-empty runqueue
+    t = find_work(c, NUM_LEVELS);
+    if (t != NULL && t->boost_epoch != epoch)
+    {
+        t->boost_epoch = epoch;
+        t->priority = 0;
+        t->allot_used = 0;
+    }
+    return t;
+}
+
+/* move every thread on c's lower levels back to the top one */
+static void boost(carrier_t *c, unsigned int epoch)
+{
+    int i;
+    long n;
+    tcb *t;
+
+    for (i = 1; i < NUM_LEVELS; i++)
+    {
+        n = rq_size(&c->rq[i]);
+        while (n-- > 0 && (t = rq_take(&c->rq[i])) != NULL)
+        {
+            if (!rq_claim(t))
+            {
+                continue;
+            }
+            t->boost_epoch = epoch;
+            t->priority = 0;
+            t->allot_used = 0;
+            rq_push(c, t);
+        }
+    }
+}
+#endif
+
+/* Give t, just switched in on c, a deadline if anyone else could use
+ * the CPU. While t has the carrier to itself nothing is armed and no
+ * signal ever arrives; make_ready() calls us again when that changes.
+ * A deadline left over from an earlier slice is kept, so switching
+ * within a level costs no syscall. MLFQ re-arms for a new level. */
+static void arm_slice(carrier_t *c, tcb *t)
+{
+    int level = 0;
+    long long ns;
+
+    if (cooperative || !others_runnable(c))
+    {
+        return;
+    }
+#if defined(MLFQ)
+    level = mlfq_level(t);
+    ns = quantum[level] * 1000000LL;
+#elif defined(CFS)
+    ns = cfs_slice(c, t);
+#else
+    ns = QUANTUM * 1000LL;
+#endif
+    if (__atomic_load_n(&c->armed_level, __ATOMIC_RELAXED) != level + 1)
+    {
+        arm_timer(c, level, ns);
+    }
+}
+
+/* program c's one-shot deadline ns from now */
+static void arm_timer(carrier_t *c, int level, long long ns)
+{
+    struct itimerspec timer;
+
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_nsec = 0;
+    timer.it_value.tv_sec = ns / 1000000000;
+    timer.it_value.tv_nsec = ns % 1000000000;
+    // flag first: if the deadline fires right away the handler clears it
+    __atomic_store_n(&c->armed_level, level + 1, __ATOMIC_RELAXED);
+    timer_settime(c->timer, 0, &timer, NULL);
+}
+
+/* Work went to the inject queue from outside any carrier and nobody is
+ * idle to take it: give one busy carrier without a deadline a base
+ * slice, so its worker gets preempted and the carrier looks. */
+static void kick_busy()
+{
+    int i, k = __atomic_fetch_add(&kick_next, 1, __ATOMIC_RELAXED);
+
+    for (i = 0; i < num_carriers; i++)
+    {
+        carrier_t *c = &carriers[(k + i) % num_carriers];
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&c->armed_level, &expected, 1, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+#if defined(MLFQ)
+            arm_timer(c, 0, quantum[0] * 1000000LL);
+#elif defined(CFS)
+            arm_timer(c, 0, CFS_GRANULARITY);
+#else
+            arm_timer(c, 0, QUANTUM * 1000LL);
+#endif
+            return;
+        }
+    }
+}
+
+/* is anything besides the running thread waiting for c? */
+static int others_runnable(carrier_t *c)
+{
+    int i;
+
+#ifdef CFS
+    if (__atomic_load_n(&c->cfs_root, __ATOMIC_RELAXED) != NULL)
+    {
+        return 1;
+    }
+#endif
+    for (i = 0; i < NUM_LEVELS; i++)
+    {
+        if (rq_size(&c->rq[i]) > 0)
+        {
+            return 1;
+        }
+    }
+    if (__atomic_load_n(&inject_head, __ATOMIC_RELAXED) != NULL)
+    {
+        return 1;
+    }
+    // timers and nobody idle to sleep until they are due: pick_next()
+    // has to run the wheel
+    if (__atomic_load_n(&wheel_count, __ATOMIC_RELAXED) > 0 &&
+        __atomic_load_n(&nr_idle, __ATOMIC_RELAXED) == 0)
+    {
+        return 1;
+    }
+    // parked I/O nobody waits for in epoll: pick_next() has to reap it
+    return __atomic_load_n(&io_waiting, __ATOMIC_RELAXED) > 0 &&
+           !__atomic_load_n(&polling, __ATOMIC_RELAXED);
+}
+
+/* Charge t for the time it has run on c since its slice started. Under
+ * MLFQ a thread that used up its allotment at a level drops one level,
+ * whether it got there in one slice or in many short ones. The check
+ * runs when t leaves the CPU, so it can overrun by at most a quantum. */
+static void account(carrier_t *c, tcb *t)
+{
+#ifdef MLFQ
+    unsigned long long now = now_ns();
+
+    t->allot_used += now - c->clock;
+    c->clock = now;
+    if (t->priority < NUM_LEVELS - 1 &&
+        t->allot_used >= allotment[t->priority] * 1000000ULL)
+    {
+        // Move the thread to a lower-priority queue
+        t->priority++;
+        t->allot_used = 0;
+    }
+#elif defined(CFS)
+    unsigned long long now = now_ns();
+
+    // heavier threads age slower, so they get picked more often
+    t->vruntime += (now - c->clock) * NICE_0_WEIGHT / t->weight;
+    c->clock = now;
+#endif
+}
+
+#ifdef CFS
+/* CFS: run the thread with the least vruntime on c's heap, falling back
+ * to the inject queue, then to the least one on another carrier. */
+static tcb *sched_cfs(carrier_t *c)
+{
+    tcb *t = NULL;
+    int k;
+
+    // look at the inject queue now and then so it can't starve
+    if (++c->ticks % 61 == 0)
+    {
+        t = inject_take();
+    }
+    if (t == NULL && c->ticks % CFS_BALANCE == 0)
+    {
+        cfs_balance(c);
+    }
+    if (t == NULL)
+    {
+        t = cfs_pop(c);
+    }
+    if (t == NULL)
+    {
+        t = inject_take();
+    }
+    for (k = 1; t == NULL && k < num_carriers; k++)
+    {
+        t = cfs_pop(&carriers[(c->carrier_id + k) % num_carriers]);
+    }
+    // what runs here counts towards c's load until the next pick
+    __atomic_store_n(&c->cfs_running, t != NULL ? t->weight : 0, __ATOMIC_RELAXED);
+    return t;
+}
+
+/* Queue t on c's vruntime heap. Its vruntime is first moved to c's
+ * clock: a new thread starts at c's min_vruntime, one coming from another
+ * carrier keeps its distance to that carrier's min_vruntime, and one that
+ * slept keeps at most CFS_LATENCY / 2 of credit. */
+static void cfs_push(carrier_t *c, tcb *t)
+{
+    spin_lock(&c->cfs_lock);
+    cfs_place(c, t);
+    t->heap_left = NULL;
+    t->heap_right = NULL;
+    t->heap_rank = 1;
+    __atomic_store_n(&c->cfs_root, cfs_merge(c->cfs_root, t), __ATOMIC_RELAXED);
+    __atomic_store_n(&c->cfs_queued, c->cfs_queued + t->weight, __ATOMIC_RELAXED);
+    spin_unlock(&c->cfs_lock);
+}
+
+/* Make t's vruntime relative to c's, and keep a sleeper from banking
+ * more than half of CFS_LATENCY of credit */
+static void cfs_place(carrier_t *c, tcb *t)
+{
+    unsigned long long floor;
+
+    if (t->cfs_home == NULL)
+    {
+        t->vruntime = c->min_vruntime;
+    }
+    else if (t->cfs_home != c)
+    {
+        t->vruntime += c->min_vruntime - __atomic_load_n(&t->cfs_home->min_vruntime, __ATOMIC_RELAXED);
+    }
+    t->cfs_home = c;
+    floor = c->min_vruntime > CFS_LATENCY / 2 ? c->min_vruntime - CFS_LATENCY / 2 : 0;
+    if ((long long)(t->vruntime - floor) < 0)
+    {
+        t->vruntime = floor;
+    }
+}
+
+/* take the thread with the least vruntime off c's heap, NULL if empty */
+static tcb *cfs_pop(carrier_t *c)
+{
+    tcb *t;
+
+    if (__atomic_load_n(&c->cfs_root, __ATOMIC_RELAXED) == NULL)
+    {
+        return NULL; // don't bother locking an empty heap
+    }
+    spin_lock(&c->cfs_lock);
+    t = cfs_take(c);
+    spin_unlock(&c->cfs_lock);
+    return t;
+}
+
+/* cfs_pop() under c->cfs_lock */
+static tcb *cfs_take(carrier_t *c)
+{
+    tcb *t = c->cfs_root;
+
+    if (t != NULL)
+    {
+        __atomic_store_n(&c->cfs_root, cfs_merge(t->heap_left, t->heap_right), __ATOMIC_RELAXED);
+        __atomic_store_n(&c->cfs_queued, c->cfs_queued - t->weight, __ATOMIC_RELAXED);
+        // everyone left is at least this far along
+        if ((long long)(t->vruntime - c->min_vruntime) > 0)
+        {
+            __atomic_store_n(&c->min_vruntime, t->vruntime, __ATOMIC_RELAXED);
+        }
+    }
+    return t;
+}
+
+/* weight runnable on c: queued on its heap, or running there */
+static unsigned long long cfs_load(carrier_t *c)
+{
+    return __atomic_load_n(&c->cfs_queued, __ATOMIC_RELAXED) +
+           __atomic_load_n(&c->cfs_running, __ATOMIC_RELAXED);
+}
+
+/* Queue t, made ready on c, on the carrier where it gets the most CPU.
+ * Weights only count against each other on one heap, so a new thread
+ * goes to the carrier with the least weight on it. A woken one stays
+ * on c, whose cache may still hold its data, unless another carrier is
+ * lighter even with t on it. */
+static void cfs_wake(carrier_t *c, tcb *t)
+{
+    carrier_t *target = c;
+    unsigned long long least = cfs_load(c), load;
+    unsigned int extra = t->cfs_home != NULL ? t->weight : 0;
+    int k;
+
+    for (k = 1; k < num_carriers; k++)
+    {
+        carrier_t *other = &carriers[(c->carrier_id + k) % num_carriers];
+        load = cfs_load(other) + extra;
+        if (load < least)
+        {
+            least = load;
+            target = other;
+        }
+    }
+    cfs_push(target, t);
+    if (target != c)
+    {
+        cfs_kick(target);
+    }
+}
+
+/* Every CFS_BALANCE picks, hand the next thread on c's heap to the
+ * carrier with the least weight on it, if that brings the two closer.
+ * Placing threads by load at wakeup can't fix what exits and sleeps do
+ * to it later. Only a carrier with something queued picks often enough
+ * to run this, so the busy ones push rather than the idle ones pull. */
+static void cfs_balance(carrier_t *c)
+{
+    carrier_t *lightest = NULL;
+    unsigned long long mine, least = ~0ULL, load;
+    tcb *t = NULL;
+    int k;
+
+    for (k = 1; k < num_carriers; k++)
+    {
+        carrier_t *other = &carriers[(c->carrier_id + k) % num_carriers];
+        load = cfs_load(other);
+        if (load < least)
+        {
+            least = load;
+            lightest = other;
+        }
+    }
+    if (lightest == NULL)
+    {
+        return;
+    }
+    spin_lock(&c->cfs_lock);
+    // in the middle of a pick nothing runs here: whoever did is queued
+    // again or gone, so the heap is all of c's load
+    mine = c->cfs_queued;
+    if (c->cfs_root != NULL && least + c->cfs_root->weight < mine)
+    {
+        t = cfs_take(c);
+    }
+    spin_unlock(&c->cfs_lock);
+    if (t != NULL)
+    {
+        cfs_push(lightest, t);
+        cfs_kick(lightest);
+    }
+}
+
+/* Give c a deadline if it runs a thread alone without one, so it looks
+ * at what was just queued on it before that thread blocks */
+static void cfs_kick(carrier_t *c)
+{
+    int expected = 0;
+
+    if (!cooperative && __atomic_load_n(&c->current, __ATOMIC_RELAXED) != NULL &&
+        __atomic_compare_exchange_n(&c->armed_level, &expected, 1, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        arm_timer(c, 0, CFS_GRANULARITY);
+    }
+}
+
+/* CFS tick: t keeps the CPU until its vruntime, counting the time it
+ * has been running, is CFS_GRANULARITY ahead of the least queued one. So
+ * slices scale with weight: a heavy thread runs longer before it has to
+ * give way. Called from the timer signal, reads the heap without locking. */
+static int cfs_keep_running(carrier_t *c, tcb *t)
+{
+    tcb *next = __atomic_load_n(&c->cfs_root, __ATOMIC_RELAXED);
+    unsigned long long vruntime;
+
+    if (next == NULL)
+    {
+        return 0; // let switch_from() look at the other queues
+    }
+    vruntime = t->vruntime + (now_ns() - c->clock) * NICE_0_WEIGHT / t->weight;
+    return (long long)(vruntime - __atomic_load_n(&next->vruntime, __ATOMIC_RELAXED)) < CFS_GRANULARITY;
+}
+
+/* Wall-clock ns until t, starting a slice on c, is CFS_GRANULARITY of
+ * vruntime past the leftmost waiter. A later, smaller waiter doesn't
+ * pull the deadline in; it is at most CFS_LATENCY away regardless. */
+static long long cfs_slice(carrier_t *c, tcb *t)
+{
+    tcb *next = __atomic_load_n(&c->cfs_root, __ATOMIC_RELAXED);
+    long long ahead = CFS_GRANULARITY;
+
+    if (next != NULL)
+    {
+        ahead += (long long)(__atomic_load_n(&next->vruntime, __ATOMIC_RELAXED) - t->vruntime);
+    }
+    ahead = ahead * t->weight / NICE_0_WEIGHT;
+    if (ahead < CFS_MIN_SLICE)
+    {
+        return CFS_MIN_SLICE;
+    }
+    return ahead < (long long)CFS_LATENCY ? ahead : (long long)CFS_LATENCY;
+}
+
+/* Merge two leftist heaps ordered by vruntime. The heap is threaded
+ * through the tcbs, so it never allocates, and recursion only follows
+ * right spines, which are O(log n) long. */
+static tcb *cfs_merge(tcb *a, tcb *b)
+{
+    tcb *t;
+
+    if (a == NULL)
+    {
+        return b;
+    }
+    if (b == NULL)
+    {
+        return a;
+    }
+    if ((long long)(b->vruntime - a->vruntime) < 0)
+    {
+        t = a;
+        a = b;
+        b = t;
+    }
+    a->heap_right = cfs_merge(a->heap_right, b);
+    if (a->heap_left == NULL || a->heap_left->heap_rank < a->heap_right->heap_rank)
+    {
+        t = a->heap_left;
+        a->heap_left = a->heap_right;
+        a->heap_right = t;
+    }
+    a->heap_rank = (a->heap_right != NULL ? a->heap_right->heap_rank : 0) + 1;
+    return a;
+}
+
+#endif
+
+/* CFS weight for a thread created with attr. SCHED_OTHER only allows
+ * priority 0, which is nice 0; under SCHED_RR or SCHED_FIFO priorities
+ * 1..99 span nice 19..-20, with 50 at about nice 0. */
+static unsigned int attr_weight(pthread_attr_t *attr)
+{
+    struct sched_param param;
+    int policy, nice = 0;
+
+    if (attr == NULL || pthread_attr_getschedpolicy(attr, &policy) != 0 ||
+        pthread_attr_getschedparam(attr, &param) != 0)
+    {
+        return NICE_0_WEIGHT;
+    }
+    if (policy == SCHED_IDLE)
+    {
+        return 3; // as in Linux
+    }
+    if (param.sched_priority >= 1 && param.sched_priority <= 99)
+    {
+        nice = 19 - (param.sched_priority - 1) * 39 / 98;
+    }
+    return nice_to_weight[nice + 20];
+}
+
+/* MLFQ level for a thread created with attr: the top one, or one level
+ * lower for about every 6 nice levels its priority is below the default */
+static int attr_level(pthread_attr_t *attr)
+{
+#ifdef MLFQ
+    unsigned int weight = attr_weight(attr);
+    int level = 0;
+
+    while (weight < NICE_0_WEIGHT && level < NUM_LEVELS - 1)
+    {
+        weight *= 4;
+        level++;
+    }
+    return level;
+#else
+    return 0;
+#endif
+}
+
+/* Stack size for a thread created with attr, rounded up to its pool
+ * class. An attr nobody set a size in reports glibc's default of
+ * megabytes; that gets our own STACK_SIZE instead. */
+static size_t attr_stack_size(pthread_attr_t *attr)
+{
+    size_t size;
+    int cls;
+
+    if (attr == NULL || pthread_attr_getstacksize(attr, &size) != 0 || size == default_stack_size)
+    {
+        return STACK_SIZE;
+    }
+    cls = stack_class(size);
+    return cls >= 0 ? stack_class_size[cls] : size;
+}
+
+#ifndef CFS
+/* Next thread for c to run: its own queues from the highest level down,
+ * then the inject queue, then one stolen off the top of another carrier.
+ * Only runnable threads are ever queued. */
+static tcb *find_work(carrier_t *c, int levels)
+{
+    tcb *t;
+    int i, k;
+
+    // look at the inject queue now and then so it can't starve
+    if (++c->ticks % 61 == 0 && (t = inject_take()) != NULL)
+    {
+        return t;
+    }
+    for (i = 0; i < levels; i++)
+    {
+        while ((t = rq_take(&c->rq[i])) != NULL)
+        {
+            if (rq_claim(t))
+            {
+                return t;
+            }
+        }
+    }
+    if ((t = inject_take()) != NULL)
+    {
+        return t;
+    }
+    for (i = 0; i < levels; i++)
+    {
+        for (k = 1; k < num_carriers; k++)
+        {
+            carrier_t *victim = &carriers[(c->carrier_id + k) % num_carriers];
+            while ((t = rq_take(&victim->rq[i])) != NULL)
+            {
+                if (rq_claim(t))
+                {
+                    return t;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+#endif
+
+// Feel free to add any other functions you need.
+// You can also create separate files for helper functions, structures, etc.
+// But make sure that the Makefile is updated to account for the same.
+
+// HELPER FUNCTIONS HERE
+
+/* carrier backing the calling kernel thread, NULL outside the runtime.
+ * Never inlined: a worker may resume on another carrier after a switch. */
+__attribute__((noinline)) carrier_t *current_carrier()
+{
+    carrier_t *c = self_carrier;
+    __asm__ __volatile__("" ::: "memory");
+    return c;
+}
+
+/* worker running on the calling kernel thread, NULL inside schedule() */
+__attribute__((noinline)) tcb *current_tcb()
+{
+    tcb *t = self_tcb;
+    __asm__ __volatile__("" ::: "memory");
+    return t;
+}
+
+/* Keep the timer from switching the calling worker out. The counter lives
+ * in the tcb so it follows the worker if it resumes on another carrier. */
+static tcb *preempt_disable()
+{
+    tcb *t = current_tcb();
+    if (t != NULL)
+    {
+        t->preempt_off++;
+    }
+    return t;
+}
+
+static void preempt_enable(tcb *t)
+{
+    if (t == NULL)
+    {
+        return;
+    }
+    if (--t->preempt_off == 0 && t->preempt_pending)
+    {
+        // a tick was deferred while we were busy, take it now
+        worker_yield();
+    }
+}
+
+/* Take the calling worker t off the CPU and switch straight to the next
+ * runnable thread. The schedule() loop is only resumed when there is none
+ * and t can't go on; if t is still runnable it simply keeps the CPU.
+ * Preemption must be off. Returns once t runs again. */
+static void switch_from(tcb *t)
+{
+    carrier_t *c = current_carrier();
+    unsigned long long now;
+    account(c, t);
+    tcb *next = pick_next(c);
+
+    t->preempt_pending = 0;
+    if (next == NULL && (t->status == THREAD_STATUS_READY || t->status == THREAD_STATUS_RUNNING))
+    {
+        t->status = THREAD_STATUS_RUNNING;
+        arm_slice(c, t);
+        return;
+    }
+
+    // t can't be published before its context is saved: whoever we
+    // switch to requeues it in finish_switch()
+    c->prev = t;
+    now = trace_clock();
+    trace(t, t->status == THREAD_STATUS_BLOCKED    ? TRACE_BLOCK
+             : t->status == THREAD_STATUS_FINISHED ? TRACE_EXIT
+                                                   : TRACE_SWITCH_OUT, now);
+    if (next != NULL)
+    {
+        next->status = THREAD_STATUS_RUNNING;
+        trace(next, TRACE_SWITCH_IN, now);
+        c->current = next;
+        self_tcb = next;
+        ctx_switch(&t->context, &next->context);
+    }
+    else
+    {
+        c->current = NULL;
+        self_tcb = NULL;
+        ctx_switch(&t->context, &c->sched_context);
+    }
+
+    // we may have been resumed on another carrier, or by a spare kernel
+    // thread, see worker_blocking_begin()
+    if ((c = current_carrier()) != NULL)
+    {
+        finish_switch(c);
+    }
+}
+
+/* take mutex for t if it is free, without waiting */
+static int mutex_trylock(worker_mutex_t *mutex, tcb *t)
+{
+    int taken = 0;
+
+    spin_lock(&mutex->wait_lock);
+    if (!mutex->locked)
+    {
+        __atomic_store_n(&mutex->locked, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&mutex->owner, t, __ATOMIC_RELAXED);
+        taken = 1;
+    }
+    spin_unlock(&mutex->wait_lock);
+    return taken;
+}
+
+/* MLFQ priority inheritance: raise mutex's owner to the best level
+ * among waiters, a list linked through next. It runs there until it
+ * unlocks, see mutex_unlend(). An owner sitting in a run queue is
+ * queued again at the new level, on c if we have one. Called under
+ * mutex->wait_lock. */
+static void mutex_lend(worker_mutex_t *mutex, tcb *waiters, carrier_t *c)
+{
+#ifdef MLFQ
+    tcb *owner = mutex->owner;
+    int level = NUM_LEVELS, lent, best, raised;
+    tcb *t;
+
+    if (owner == NULL)
+    {
+        return; // taken from outside a worker, no level to raise
+    }
+    for (t = waiters; t != NULL; t = t->next)
+    {
+        if (mlfq_level(t) < level)
+        {
+            level = mlfq_level(t);
+        }
+    }
+    if (level >= mlfq_level(owner))
+    {
+        return;
+    }
+
+    // lent counts the mutexes the owner holds that lent it a level,
+    // above the best such level + 1. Other mutexes it holds may be
+    // lending to it at the same time.
+    lent = __atomic_load_n(&owner->lent, __ATOMIC_RELAXED);
+    do
+    {
+        best = lent & 0xff;
+        if (best == 0 || best > level + 1)
+        {
+            best = level + 1;
+        }
+        raised = ((lent >> 8) + !mutex->lent) << 8 | best;
+    } while (!__atomic_compare_exchange_n(&owner->lent, &lent, raised, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    mutex->lent = 1;
+    mutex->stats.inversions++;
+
+    if (c != NULL && rq_claim(owner))
+    {
+        rq_push(c, owner);
+    }
+#endif
+}
+
+/* Take back what mutex's waiters lent owner. Returns 1 when that was the
+ * last mutex lending to it, so it is back at its own level. Called under
+ * mutex->wait_lock. */
+static int mutex_unlend(worker_mutex_t *mutex, tcb *owner)
+{
+    int lent, left;
+
+    if (!mutex->lent)
+    {
+        return 0;
+    }
+    mutex->lent = 0;
+    lent = __atomic_load_n(&owner->lent, __ATOMIC_RELAXED);
+    do
+    {
+        // the level stays as high as the best lender until the last goes
+        left = (lent >> 8) > 1 ? lent - (1 << 8) : 0;
+    } while (!__atomic_compare_exchange_n(&owner->lent, &lent, left, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return left == 0;
+}
+
+#ifdef MLFQ
+/* MLFQ level t runs at: its own, or a better one lent by mutex waiters */
+static int mlfq_level(tcb *t)
+{
+    int lent = (__atomic_load_n(&t->lent, __ATOMIC_RELAXED) & 0xff) - 1;
+    return lent >= 0 && lent < t->priority ? lent : t->priority;
+}
+#endif
+
+/* Spin while mutex is held by a worker running on another carrier. The
+ * budget, counted from start, is twice the mutex's recent average hold
+ * time, capped at SPIN_MAX_NS. Returns 1 when the mutex looks free, 0
+ * when it is time to park instead. */
+static int mutex_spin(worker_mutex_t *mutex, unsigned long long start)
+{
+    long long budget = 2 * mutex->avg_hold_ns;
+    unsigned int i;
+    tcb *owner;
+
+    if (num_carriers < 2 || budget <= 0)
+    {
+        return 0; // the owner can't be running right now, or we never learned
+    }
+    if (budget > SPIN_MAX_NS)
+    {
+        budget = SPIN_MAX_NS;
+    }
+
+    for (i = 1;; i++)
+    {
+        if (!__atomic_load_n(&mutex->locked, __ATOMIC_RELAXED))
+        {
+            return 1;
+        }
+        // parked waiters get it first, and an owner that is off the CPU
+        // won't let go any time soon
+        owner = __atomic_load_n(&mutex->owner, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&mutex->wait_head, __ATOMIC_RELAXED) != NULL ||
+            (owner != NULL && __atomic_load_n(&owner->status, __ATOMIC_RELAXED) != THREAD_STATUS_RUNNING))
+        {
+            return 0;
+        }
+        cpu_relax();
+        if (i % 64 == 0 && (long long)(now_ns() - start) > budget)
+        {
+            return 0;
+        }
+    }
+}
+
+/* monotonic clock in nanoseconds */
+static unsigned long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Block t, which the caller has put on a wait queue guarded by lock.
+ * lock is held on entry and released only once t is off the CPU, so
+ * whoever takes t off that queue can hand it to wake() right away.
+ * Preemption must be off. Returns once t has been woken and runs again. */
+static void park(tcb *t, atomic_flag *lock)
+{
+    if (t->tasks != NULL && t->in_task)
+    {
+        // a pool worker stuck in a task: let another one at the queued tasks
+        __atomic_add_fetch(&task_pool_blocked, 1, __ATOMIC_SEQ_CST);
+        if (task_available())
+        {
+            task_notify();
+        }
+        t->status = THREAD_STATUS_BLOCKED;
+        current_carrier()->prev_lock = lock;
+        switch_from(t);
+        __atomic_sub_fetch(&task_pool_blocked, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    t->status = THREAD_STATUS_BLOCKED;
+    current_carrier()->prev_lock = lock;
+    switch_from(t);
+}
+
+/* make t, taken off a wait queue, runnable again */
+static void wake(tcb *t)
+{
+    t->status = THREAD_STATUS_READY;
+    trace(t, TRACE_WAKE, trace_clock());
+    make_ready(t);
+}
+
+/* Wake t, taken off a wait queue, by handing it the calling worker self's
+ * CPU at once instead of queueing it. self goes back on the run queue as
+ * if it had yielded. Preemption must be off. */
+static void wake_switch(tcb *self, tcb *t)
+{
+    carrier_t *c = current_carrier();
+    unsigned long long now;
+
+    account(c, self);
+#ifdef CFS
+    cfs_place(c, t);
+    __atomic_store_n(&c->cfs_running, t->weight, __ATOMIC_RELAXED);
+#endif
+    self->status = THREAD_STATUS_READY;
+    self->preempt_pending = 0;
+    c->prev = self;
+    now = trace_clock();
+    trace(t, TRACE_WAKE, now);
+    trace(self, TRACE_SWITCH_OUT, now);
+    t->status = THREAD_STATUS_RUNNING;
+    trace(t, TRACE_SWITCH_IN, now);
+    c->current = t;
+    self_tcb = t;
+    ctx_switch(&self->context, &t->context);
+
+    finish_switch(current_carrier());
+}
+
+/* Called right after every switch by the side that got the CPU: put the
+ * thread that left it where it belongs now that its context is saved. */
+static void finish_switch(carrier_t *c)
+{
+    tcb *t = c->prev;
+
+    if (t != NULL)
+    {
+        c->prev = NULL;
+        requeue(c, t);
+    }
+    // whoever runs now may have to make room for what is queued
+    if (c->current != NULL)
+    {
+        arm_slice(c, c->current);
+    }
+}
+
+/* put t, just saved by a switch on c, wherever its status says */
+static void requeue(carrier_t *c, tcb *t)
+{
+    if (c->prev_lock != NULL)
+    {
+        // Parked on a wait queue: now that it is saved, let its waker
+        // at it. Whoever wakes it puts it back on a run queue.
+        spin_unlock(c->prev_lock);
+        c->prev_lock = NULL;
+        return;
+    }
+
+    if (t->status == THREAD_STATUS_FINISHED)
+    {
+        // No free() here: a preempted worker may hold the malloc lock.
+        // The next worker_create or idle round on this carrier reaps it.
+        t->next = c->dead;
+        c->dead = t;
+        return;
+    }
+    if (t->status == THREAD_STATUS_RUNNING)
+    {
+        // Timer took it off the CPU: it used up its time slice.
+        // account() already moved it down if it used up its allotment.
+        t->status = THREAD_STATUS_READY;
+    }
+    // A thread that yielded or blocked keeps its level
+    rq_push(c, t);
+}
+
+void spin_lock(atomic_flag *lock)
+{
+    while (atomic_flag_test_and_set_explicit(lock, memory_order_acquire))
+    {
+        cpu_relax();
+    }
+}
+
+void spin_unlock(atomic_flag *lock)
+{
+    atomic_flag_clear_explicit(lock, memory_order_release);
+}
+
+/* Publish t on the calling carrier's queue and wake an idle carrier so it
+ * can steal it. From outside the runtime t goes to the inject queue. */
+static void make_ready(tcb *t)
+{
+    tcb *self = preempt_disable();
+    carrier_t *c = current_carrier();
+
+    if (c != NULL)
+    {
+#ifdef CFS
+        cfs_wake(c, t);
+#else
+        rq_push(c, t);
+#endif
+        if (self != NULL)
+        {
+            // we may have been running alone, without a deadline
+            arm_slice(c, self);
+        }
+    }
+    else
+    {
+        inject_push(t);
+    }
+
+    __atomic_add_fetch(&work_seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&nr_idle, __ATOMIC_SEQ_CST) > 0)
+    {
+        if (syscall(SYS_futex, &work_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0) == 0 &&
+            __atomic_load_n(&polling, __ATOMIC_SEQ_CST))
+        {
+            // the only idle carrier is waiting for I/O
+            unsigned long long one = 1;
+            write(wake_fd, &one, sizeof(one));
+        }
+    }
+    else if (c == NULL && !cooperative)
+    {
+        kick_busy();
+    }
+
+    preempt_enable(self);
+}
+
+/* Take ready events off the epoll set, waiting up to timeout ns (< 0:
+ * for ever), and wake the workers parked on them. Returns how many were
+ * woken. */
+static int io_poll(carrier_t *c, long long timeout)
+{
+    struct epoll_event events[IO_EVENTS];
+    struct timespec ts;
+    unsigned long long count;
+    int n, i, woken = 0;
+
+    if (__atomic_load_n(&io_waiting, __ATOMIC_RELAXED) == 0)
+    {
+        return 0;
+    }
+    ts.tv_sec = timeout / 1000000000;
+    ts.tv_nsec = timeout % 1000000000;
+    n = epoll_pwait2(epoll_fd, events, IO_EVENTS, timeout >= 0 ? &ts : NULL, NULL);
+    for (i = 0; i < n; i++)
+    {
+        if (events[i].data.fd == wake_fd)
+        {
+            read(wake_fd, &count, sizeof(count));
+            continue;
+        }
+        woken += io_ready(c, events[i].data.fd, events[i].events);
+    }
+    return woken;
+}
+
+/* Wake the workers waiting on fd for any of revents. The registration
+ * is one-shot, so it is re-armed for whoever is left. */
+static int io_ready(carrier_t *c, int fd, unsigned int revents)
+{
+    io_fd_t *f = io_entry(fd, 0);
+    io_wait_t *fire = NULL, *wait;
+    io_waiter_t *w;
+    unsigned int rest = 0;
+    int n = 0;
+
+    if (f == NULL)
+    {
+        return 0;
+    }
+    spin_lock(&f->lock);
+    f->armed = 0;
+    for (w = f->waiters; w != NULL; w = w->next)
+    {
+        if (__atomic_load_n(&w->wait->fired, __ATOMIC_ACQUIRE))
+        {
+            continue; // woken through another fd, leaving
+        }
+        if (revents & (w->events | EPOLLERR | EPOLLHUP))
+        {
+            if (!__atomic_exchange_n(&w->wait->fired, 1, __ATOMIC_ACQ_REL))
+            {
+                w->wait->next = fire;
+                fire = w->wait;
+            }
+        }
+        else
+        {
+            rest |= w->events;
+        }
+    }
+    if (rest != 0)
+    {
+        io_arm(fd, f, rest);
+    }
+    spin_unlock(&f->lock);
+
+    // A fired wait stays valid until its thread runs again
+    while ((wait = fire) != NULL)
+    {
+        tcb *t = wait->t;
+        fire = wait->next;
+        n++;
+        if (t == c->current)
+        {
+            // t is parking in switch_from() on this very carrier, and
+            // still holds the lock: keep it off the wait instead
+            c->prev_lock = NULL;
+            spin_unlock(&wait->lock);
+            t->status = THREAD_STATUS_READY;
+            continue;
+        }
+        // the lock is released once t is off the CPU
+        spin_lock(&wait->lock);
+        spin_unlock(&wait->lock);
+        wake(t);
+    }
+    return n;
+}
+
+/* Add node to fd's waiters, arming fd for events. -1 if epoll won't have it. */
+static int io_watch(io_waiter_t *node, io_wait_t *wait, int fd, unsigned int events)
+{
+    io_fd_t *f = io_entry(fd, 1);
+    int rc = 0;
+
+    if (f == NULL)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    node->wait = wait;
+    node->fd = fd;
+    node->events = events;
+
+    spin_lock(&f->lock);
+    if ((f->armed & events) != events)
+    {
+        rc = io_arm(fd, f, f->armed | events);
+    }
+    if (rc == 0)
+    {
+        node->next = f->waiters;
+        f->waiters = node;
+    }
+    spin_unlock(&f->lock);
+    return rc;
+}
+
+/* take node off its fd's waiters */
+static void io_unwatch(io_waiter_t *node)
+{
+    io_fd_t *f = io_entry(node->fd, 0);
+    io_waiter_t **p;
+
+    spin_lock(&f->lock);
+    for (p = &f->waiters; *p != NULL; p = &(*p)->next)
+    {
+        if (*p == node)
+        {
+            *p = node->next;
+            break;
+        }
+    }
+    spin_unlock(&f->lock);
+}
+
+/* (Re)register fd in the epoll set for one event out of events. An fd
+ * closed and reopened since has silently left the set, so on ENOENT
+ * add it again. Runs under f->lock. */
+static int io_arm(int fd, io_fd_t *f, unsigned int events)
+{
+    struct epoll_event ev;
+    int op = f->added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events | EPOLLONESHOT;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, op, fd, &ev) < 0)
+    {
+        op = errno == ENOENT ? EPOLL_CTL_ADD : errno == EEXIST ? EPOLL_CTL_MOD : -1;
+        if (op < 0 || epoll_ctl(epoll_fd, op, fd, &ev) < 0)
+        {
+            return -1;
+        }
+    }
+    f->added = 1;
+    f->armed = events;
+    return 0;
+}
+
+/* I/O state of fd, growing the table by a chunk if create is set */
+static io_fd_t *io_entry(int fd, int create)
+{
+    io_fd_t *chunk;
+
+    if (fd < 0 || fd >= MAX_FDS)
+    {
+        return NULL;
+    }
+    chunk = __atomic_load_n(&io_chunks[fd / IO_CHUNK], __ATOMIC_ACQUIRE);
+    if (chunk == NULL && create)
+    {
+        spin_lock(&io_table_lock);
+        chunk = io_chunks[fd / IO_CHUNK];
+        if (chunk == NULL && (chunk = calloc(IO_CHUNK, sizeof(io_fd_t))) != NULL)
+        {
+            __atomic_store_n(&io_chunks[fd / IO_CHUNK], chunk, __ATOMIC_RELEASE);
+        }
+        spin_unlock(&io_table_lock);
+    }
+    return chunk != NULL ? &chunk[fd % IO_CHUNK] : NULL;
+}
+
+/* poll(2) without waiting. Nothing can be lost to EINTR here, and a
+ * preemption tick may well land in it, so try again. */
+static int io_probe(struct pollfd *fds, nfds_t nfds)
+{
+    int n;
+
+    while ((n = poll(fds, nfds, 0)) < 0 && errno == EINTR)
+    {
+    }
+    return n;
+}
+
+/* Workers never block in the kernel on fd: make it non-blocking and
+ * park on EAGAIN. It stays that way, like in other green thread runtimes. */
+static void io_nonblock(int fd)
+{
+    int flags;
+
+    if (current_tcb() == NULL)
+    {
+        return; // outside a worker, blocking is fine
+    }
+    flags = fcntl(fd, F_GETFL);
+    if (flags >= 0 && !(flags & O_NONBLOCK))
+    {
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+}
+
+/* Wait on cond until the monotonic deadline if it isn't 0. A waiter
+ * cond_release() moved onto the mutex's queue wakes up owning it. */
+static int cond_wait(worker_cond_t *cond, worker_mutex_t *mutex, unsigned long long deadline)
+{
+    tcb *self = preempt_disable();
+    int timed_out = 0;
+    wtimer_t timer;
+
+    if (self == NULL)
+    {
+        // Not a worker, there is nothing to park. Waking up without a
+        // signal is allowed, so just give the others a chance.
+        worker_mutex_unlock(mutex);
+        sched_yield();
+        worker_mutex_lock(mutex);
+        return deadline != 0 && now_ns() >= deadline ? ETIMEDOUT : 0;
+    }
+
+    spin_lock(&cond->lock);
+    cond->mutex = mutex;
+    self->handoff = 0;
+    self->next = NULL;
+    if (cond->wait_tail != NULL)
+    {
+        cond->wait_tail->next = self;
+    }
+    else
+    {
+        __atomic_store_n(&cond->wait_head, self, __ATOMIC_RELAXED);
+    }
+    cond->wait_tail = self;
+    if (deadline != 0)
+    {
+        timer_init(&timer, self, &cond->lock, cond, &cond_dequeue);
+        timer_add(&timer, deadline);
+    }
+
+    // still under cond->lock, so no signal can slip in before we park
+    mutex_unlock(mutex);
+    park(self, &cond->lock);
+    if (deadline != 0)
+    {
+        timed_out = timer_cancel(&timer);
+    }
+
+    if (self->handoff)
+    {
+        unsigned long long now = now_ns();
+        mutex->stats.acquisitions++;
+        mutex->stats.contended++;
+        mutex->acquired_at = now;
+    }
+    else
+    {
+        worker_mutex_lock(mutex);
+    }
+    preempt_enable(self);
+    return timed_out ? ETIMEDOUT : 0;
+}
+
+/* Take the longest waiter, or all of them, off cond. Each would go
+ * straight back to sleep on the mutex if it is held, so move them onto
+ * its queue instead; unlocks hand it to them one by one. If it is free,
+ * wake them together. */
+static void cond_release(worker_cond_t *cond, int all)
+{
+    tcb *self = preempt_disable();
+    worker_mutex_t *mutex;
+    tcb *head, *tail, *t;
+
+    spin_lock(&cond->lock);
+    head = cond->wait_head;
+    if (head == NULL)
+    {
+        spin_unlock(&cond->lock);
+        preempt_enable(self);
+        return;
+    }
+    if (all)
+    {
+        tail = cond->wait_tail;
+        cond->wait_tail = NULL;
+        __atomic_store_n(&cond->wait_head, NULL, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        tail = head;
+        __atomic_store_n(&cond->wait_head, head->next, __ATOMIC_RELAXED);
+        if (head->next == NULL)
+        {
+            cond->wait_tail = NULL;
+        }
+        head->next = NULL;
+    }
+    mutex = cond->mutex;
+    spin_unlock(&cond->lock);
+
+    spin_lock(&mutex->wait_lock);
+    if (mutex->locked)
+    {
+        for (t = head; t != NULL; t = t->next)
+        {
+            t->handoff = 1;
+        }
+        if (mutex->wait_tail != NULL)
+        {
+            mutex->wait_tail->next = head;
+        }
+        else
+        {
+            __atomic_store_n(&mutex->wait_head, head, __ATOMIC_RELAXED);
+        }
+        mutex->wait_tail = tail;
+        mutex_lend(mutex, head, self != NULL ? current_carrier() : NULL);
+        spin_unlock(&mutex->wait_lock);
+    }
+    else
+    {
+        spin_unlock(&mutex->wait_lock);
+        wake_all(head);
+    }
+    preempt_enable(self);
+}
+
+/* cond_wait: take the waiter off cond, unless a signal got it first */
+static int cond_dequeue(wtimer_t *timer)
+{
+    worker_cond_t *cond = (worker_cond_t *)timer->wait;
+    tcb *prev = NULL, *t;
+
+    for (t = cond->wait_head; t != NULL && t != timer->t; t = t->next)
+    {
+        prev = t;
+    }
+    if (t == NULL)
+    {
+        return 0;
+    }
+    if (prev != NULL)
+    {
+        prev->next = t->next;
+    }
+    else
+    {
+        __atomic_store_n(&cond->wait_head, t->next, __ATOMIC_RELAXED);
+    }
+    if (cond->wait_tail == t)
+    {
+        cond->wait_tail = prev;
+    }
+    return 1;
+}
+
+/* Set up timer to wake t, parked under lock on wait, when it is due */
+static void timer_init(wtimer_t *timer, tcb *t, atomic_flag *lock, void *wait,
+                       int (*dequeue)(wtimer_t *timer))
+{
+    memset(timer, 0, sizeof(wtimer_t));
+    timer->t = t;
+    timer->lock = lock;
+    timer->wait = wait;
+    timer->dequeue = dequeue;
+}
+
+/* Put timer in the wheel, due at deadline on the monotonic clock. The
+ * caller still holds timer->lock and parks right after. */
+static void timer_add(wtimer_t *timer, unsigned long long deadline)
+{
+    unsigned long long idle;
+
+    spin_lock(&wheel_lock);
+    // An empty wheel may have stopped turning long ago, when its last
+    // timer was cancelled: start it again from now, not from there
+    if (wheel_count == 0)
+    {
+        wheel_next = now_ns() / WHEEL_TICK;
+    }
+    timer->expires = (deadline + WHEEL_TICK - 1) / WHEEL_TICK;
+    timer->state = TIMER_PENDING;
+    wheel_insert(timer);
+    __atomic_add_fetch(&wheel_count, 1, __ATOMIC_SEQ_CST);
+    spin_unlock(&wheel_lock);
+
+    // Idle carriers sleep until the deadline they last saw. If ours is
+    // sooner, or one is still working it out, get them to look again.
+    if (__atomic_load_n(&nr_idle, __ATOMIC_SEQ_CST) > 0)
+    {
+        idle = __atomic_load_n(&idle_deadline, __ATOMIC_SEQ_CST);
+        if (idle == 0 || timer->expires * WHEEL_TICK < idle)
+        {
+            wake_idle();
+        }
+    }
+}
+
+/* Take timer out of the wheel if it hasn't fired, waiting out a callback
+ * already running on it. Returns 1 if it took its waiter off the wait. */
+static int timer_cancel(wtimer_t *timer)
+{
+    spin_lock(&wheel_lock);
+    if (timer->state == TIMER_PENDING)
+    {
+        wheel_unlink(timer);
+        __atomic_sub_fetch(&wheel_count, 1, __ATOMIC_RELAXED);
+        timer->state = TIMER_IDLE;
+    }
+    spin_unlock(&wheel_lock);
+
+    while (__atomic_load_n(&timer->state, __ATOMIC_ACQUIRE) == TIMER_FIRING)
+    {
+        cpu_relax();
+    }
+    return timer->fired;
+}
+
+/* Advance the wheel to now and wake every waiter whose timer is due.
+ * One carrier runs it at a time, the others don't wait for it. Returns
+ * how many waiters it woke. */
+static int timer_run()
+{
+    wtimer_t *due = NULL, *timer, *next;
+    unsigned long long now, rest;
+    unsigned int index;
+    int woken = 0;
+
+    if (__atomic_load_n(&wheel_count, __ATOMIC_RELAXED) == 0)
+    {
+        return 0;
+    }
+    now = now_ns() / WHEEL_TICK;
+    if (now < __atomic_load_n(&wheel_next, __ATOMIC_RELAXED) ||
+        atomic_flag_test_and_set_explicit(&wheel_lock, memory_order_acquire))
+    {
+        return 0;
+    }
+
+    while (wheel_next <= now && wheel_count > 0)
+    {
+        index = wheel_next & (WHEEL_SLOTS - 1);
+        if (index == 0)
+        {
+            wheel_cascade();
+        }
+        for (timer = wheel[0][index]; timer != NULL; timer = next)
+        {
+            next = timer->next;
+            __atomic_store_n(&timer->state, TIMER_FIRING, __ATOMIC_RELAXED);
+            timer->next = due;
+            due = timer;
+            __atomic_sub_fetch(&wheel_count, 1, __ATOMIC_RELAXED);
+        }
+        wheel[0][index] = NULL;
+        wheel_used[0] &= ~(1ULL << index);
+
+        // skip empty slots, up to the next cascade at the latest
+        rest = index + 1 < WHEEL_SLOTS ? wheel_used[0] >> (index + 1) : 0;
+        wheel_next += rest != 0 ? (unsigned int)__builtin_ctzll(rest) + 1 : WHEEL_SLOTS - index;
+    }
+    if (wheel_next > now + 1 || wheel_count == 0)
+    {
+        wheel_next = now + 1;
+    }
+    spin_unlock(&wheel_lock);
+
+    // The waiters can't leave before their timer is back to idle
+    while ((timer = due) != NULL)
+    {
+        tcb *t = timer->t;
+        due = timer->next;
+        spin_lock(timer->lock);
+        if (timer->dequeue(timer))
+        {
+            timer->fired = 1;
+            spin_unlock(timer->lock);
+            wake(t);
+            woken++;
+        }
+        else
+        {
+            spin_unlock(timer->lock); // woken the normal way first
+        }
+        __atomic_store_n(&timer->state, TIMER_IDLE, __ATOMIC_RELEASE);
+    }
+    return woken;
+}
+
+/* Monotonic time of the next tick that fires or cascades a timer, 0 if
+ * there are none. Idle carriers sleep until then. */
+static unsigned long long timer_next()
+{
+    unsigned long long best = ~0ULL, base, used, tick;
+    int level, shift, r;
+
+    spin_lock(&wheel_lock);
+    if (wheel_count == 0)
+    {
+        spin_unlock(&wheel_lock);
+        return 0;
+    }
+    for (level = 0; level < WHEEL_LEVELS; level++)
+    {
+        if ((used = wheel_used[level]) == 0)
+        {
+            continue;
+        }
+        // A level acts on a slot every 1 << shift ticks, in slot order,
+        // starting with the first such tick not run yet
+        shift = level * WHEEL_BITS;
+        base = (wheel_next + (1ULL << shift) - 1) >> shift;
+        r = base & (WHEEL_SLOTS - 1);
+        used = r != 0 ? used >> r | used << (WHEEL_SLOTS - r) : used;
+        tick = (base + __builtin_ctzll(used)) << shift;
+        if (tick < best)
+        {
+            best = tick;
+        }
+    }
+    spin_unlock(&wheel_lock);
+    return best * WHEEL_TICK;
+}
+
+/* Put timer in the slot for its expiry, relative to wheel_next: level 0
+ * has a slot per tick, every level above a slot per whole level below.
+ * Runs under wheel_lock. */
+static void wheel_insert(wtimer_t *timer)
+{
+    unsigned long long expires = timer->expires, delta;
+    unsigned int index;
+    int level = 0;
+
+    if (expires < wheel_next)
+    {
+        expires = timer->expires = wheel_next;
+    }
+    delta = expires - wheel_next;
+    while (level < WHEEL_LEVELS - 1 && delta >= 1ULL << ((level + 1) * WHEEL_BITS))
+    {
+        level++;
+    }
+    if (delta >= 1ULL << (WHEEL_LEVELS * WHEEL_BITS))
+    {
+        // too far out: park it in the last slot, it is sorted again there
+        expires = wheel_next + (1ULL << (WHEEL_LEVELS * WHEEL_BITS)) - 1;
+    }
+    index = (expires >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1);
+
+    timer->slot = level * WHEEL_SLOTS + index;
+    timer->prev = NULL;
+    timer->next = wheel[level][index];
+    if (timer->next != NULL)
+    {
+        timer->next->prev = timer;
+    }
+    wheel[level][index] = timer;
+    wheel_used[level] |= 1ULL << index;
+}
+
+/* take timer out of its slot in O(1), under wheel_lock */
+static void wheel_unlink(wtimer_t *timer)
+{
+    int level = timer->slot / WHEEL_SLOTS;
+    unsigned int index = timer->slot % WHEEL_SLOTS;
+
+    if (timer->prev != NULL)
+    {
+        timer->prev->next = timer->next;
+    }
+    else
+    {
+        wheel[level][index] = timer->next;
+    }
+    if (timer->next != NULL)
+    {
+        timer->next->prev = timer->prev;
+    }
+    if (wheel[level][index] == NULL)
+    {
+        wheel_used[level] &= ~(1ULL << index);
+    }
+}
+
+/* wheel_next starts a new lap of level 0: spread the next slot of level
+ * 1 over it, and likewise up the levels that start a lap too */
+static void wheel_cascade()
+{
+    wtimer_t *timer, *next;
+    unsigned int index;
+    int level;
+
+    for (level = 1; level < WHEEL_LEVELS; level++)
+    {
+        index = (wheel_next >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1);
+        timer = wheel[level][index];
+        wheel[level][index] = NULL;
+        wheel_used[level] &= ~(1ULL << index);
+        for (; timer != NULL; timer = next)
+        {
+            next = timer->next;
+            wheel_insert(timer);
+        }
+        if (index != 0)
+        {
+            break;
+        }
+    }
+}
+
+/* worker_sleep_ns: only the timer wakes a sleeper */
+static int sleep_dequeue(wtimer_t *timer)
+{
+    return 1;
+}
+
+/* mutex_lock: take the waiter out of the mutex's FIFO, unless the
+ * unlocker already handed it the mutex */
+static int mutex_dequeue(wtimer_t *timer)
+{
+    worker_mutex_t *mutex = (worker_mutex_t *)timer->wait;
+    tcb *prev = NULL, *t;
+
+    for (t = mutex->wait_head; t != NULL && t != timer->t; t = t->next)
+    {
+        prev = t;
+    }
+    if (t == NULL)
+    {
+        return 0;
+    }
+    if (prev != NULL)
+    {
+        prev->next = t->next;
+    }
+    else
+    {
+        __atomic_store_n(&mutex->wait_head, t->next, __ATOMIC_RELAXED);
+    }
+    if (mutex->wait_tail == t)
+    {
+        mutex->wait_tail = prev;
+    }
+    return 1;
+}
+
+/* worker_poll: claim the wait, unless one of its fds fired first */
+static int poll_dequeue(wtimer_t *timer)
+{
+    io_wait_t *wait = (io_wait_t *)timer->wait;
+
+    return !__atomic_exchange_n(&wait->fired, 1, __ATOMIC_ACQ_REL);
+}
+
+/* join: take the joiner off the thread's list, unless it already
+ * finished. Then the thread can be joined again. */
+static int join_dequeue(wtimer_t *timer)
+{
+    tcb *target = (tcb *)timer->wait;
+    tcb **p;
+
+    for (p = &target->joiners; *p != NULL; p = &(*p)->next)
+    {
+        if (*p == timer->t)
+        {
+            *p = timer->t->next;
+            target->joined = 0;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* get every idle carrier to look at the queues and the wheel again */
+static void wake_idle()
+{
+    unsigned long long one = 1;
+
+    __atomic_add_fetch(&work_seq, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &work_seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    if (__atomic_load_n(&polling, __ATOMIC_SEQ_CST))
+    {
+        write(wake_fd, &one, sizeof(one));
+    }
+}
+
+/* Make a list of threads taken off a wait queue, linked through next,
+ * runnable in one go: one work_seq bump, and one futex call waking as
+ * many idle carriers as it takes. */
+static void wake_all(tcb *list)
+{
+    tcb *self = preempt_disable();
+    carrier_t *c = current_carrier();
+    tcb *t;
+    int n = 0, idle;
+
+    while ((t = list) != NULL)
+    {
+        list = t->next;
+        t->status = THREAD_STATUS_READY;
+        trace(t, TRACE_WAKE, trace_clock());
+        if (c != NULL)
+        {
+#ifdef CFS
+            cfs_wake(c, t);
+#else
+            rq_push(c, t);
+#endif
+        }
+        else
+        {
+            inject_push(t);
+        }
+        n++;
+    }
+    if (n == 0)
+    {
+        preempt_enable(self);
+        return;
+    }
+    if (c != NULL && self != NULL)
+    {
+        arm_slice(c, self);
+    }
+
+    __atomic_add_fetch(&work_seq, 1, __ATOMIC_SEQ_CST);
+    idle = __atomic_load_n(&nr_idle, __ATOMIC_SEQ_CST);
+    if (idle > 0)
+    {
+        if (syscall(SYS_futex, &work_seq, FUTEX_WAKE_PRIVATE, n < idle ? n : idle, NULL, NULL, 0) == 0 &&
+            __atomic_load_n(&polling, __ATOMIC_SEQ_CST))
+        {
+            unsigned long long one = 1;
+            write(wake_fd, &one, sizeof(one));
+        }
+    }
+    else if (c == NULL && !cooperative)
+    {
+        kick_busy();
+    }
+    preempt_enable(self);
+}
+
+/* Queue task as part of group for the task pool: on the caller's own
+ * deque if it is a pool worker, else on the task inject queue. Then get
+ * an idle pool worker to take it, or start one if too few are running. */
+static void task_spawn(task_t *task, worker_task_group_t *group)
+{
+    tcb *self;
+
+    if (init_sched_finish == 0)
+    {
+        init_scheduler(); // the caller becomes a worker
+    }
+    self = preempt_disable();
+    task->group = group;
+    __atomic_add_fetch(&group->pending, 1, __ATOMIC_RELAXED);
+
+    if (self == NULL || self->tasks == NULL || td_push(self->tasks, task) < 0)
+    {
+        task->next = NULL;
+        spin_lock(&task_lock);
+        if (task_inject_tail == NULL)
+        {
+            task_inject_head = task;
+        }
+        else
+        {
+            task_inject_tail->next = task;
+        }
+        task_inject_tail = task;
+        spin_unlock(&task_lock);
+    }
+
+    // pairs with the idle pool worker's look at the queues after it
+    // counts itself in task_pool_idle
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    task_notify();
+    preempt_enable(self);
+}
+
+/* Wake an idle pool worker to run what was just queued, or start one if
+ * none is idle and fewer than num_carriers are free to run tasks.
+ * Preemption must be off. */
+static void task_notify()
+{
+    tcb *idle = NULL;
+
+    if (__atomic_load_n(&task_pool_idle, __ATOMIC_RELAXED) > 0)
+    {
+        spin_lock(&task_lock);
+        if ((idle = task_idle) != NULL)
+        {
+            task_idle = idle->next;
+            task_pool_idle--;
+        }
+        spin_unlock(&task_lock);
+    }
+    if (idle != NULL)
+    {
+        wake(idle);
+    }
+    else if (__atomic_load_n(&task_pool_size, __ATOMIC_ACQUIRE) -
+                 __atomic_load_n(&task_pool_blocked, __ATOMIC_RELAXED) < num_carriers)
+    {
+        task_grow();
+    }
+}
+
+/* Run task on the calling thread, then tell its group */
+static void task_run(tcb *self, task_t *task)
+{
+    worker_task_group_t *group = task->group;
+    tcb *waiters = NULL;
+
+    if (self != NULL)
+    {
+        self->in_task++;
+    }
+    task->function(task->arg);
+    if (self != NULL)
+    {
+        self->in_task--;
+    }
+    if (task->heap)
+    {
+        worker_free(task);
+    }
+
+    // under the lock, so the group is not touched once its waiter can
+    // see it empty and return. Its waiters park holding it with
+    // preemption off, so no tick may switch us out in here.
+    self = preempt_disable();
+    spin_lock(&group->lock);
+    if (--group->pending == 0)
+    {
+        waiters = group->waiters;
+        group->waiters = NULL;
+    }
+    spin_unlock(&group->lock);
+    preempt_enable(self);
+    wake_all(waiters);
+}
+
+/* Until group is empty, run whatever tasks can be found, this group's or
+ * not; park when there are none, and let the pool finish it. Others'
+ * tasks nest on our stack, so they are only taken while there is room. */
+static void task_wait(worker_task_group_t *group)
+{
+    tcb *self = current_tcb();
+    task_t *task;
+    char here;
+
+    while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0)
+    {
+        int room = self != NULL && (self->stack != NULL
+                                        ? (size_t)(&here - (char *)self->stack) > TASK_STACK_RESERVE
+                                        : self->in_task < TASK_NEST_MAX);
+        if ((task = task_find(self, room)) != NULL)
+        {
+            task_run(self, task);
+            continue;
+        }
+        self = preempt_disable();
+        if (self == NULL)
+        {
+            sched_yield(); // not a worker, nothing to park
+            continue;
+        }
+        spin_lock(&group->lock);
+        if (group->pending == 0)
+        {
+            spin_unlock(&group->lock);
+            preempt_enable(self);
+            break;
+        }
+        self->next = group->waiters;
+        group->waiters = self;
+        park(self, &group->lock);
+        preempt_enable(self);
+    }
+    // the last task may still be letting go of the lock
+    self = preempt_disable();
+    spin_lock(&group->lock);
+    spin_unlock(&group->lock);
+    preempt_enable(self);
+}
+
+/* A task for self: its own newest, then, if others is set, the oldest
+ * one started outside the pool, then the oldest of another pool worker's */
+static task_t *task_find(tcb *self, int others)
+{
+    task_t *task;
+    int n, start, i;
+
+    if (self != NULL && self->tasks != NULL && (task = td_pop(self->tasks)) != NULL)
+    {
+        return task;
+    }
+    if (!others)
+    {
+        return NULL;
+    }
+    if (__atomic_load_n(&task_inject_head, __ATOMIC_RELAXED) != NULL)
+    {
+        // task_spawn() and the idle pool workers spin on task_lock with
+        // preemption off, so no tick may switch us out holding it
+        tcb *t = preempt_disable();
+        spin_lock(&task_lock);
+        if ((task = task_inject_head) != NULL)
+        {
+            task_inject_head = task->next;
+            if (task_inject_head == NULL)
+            {
+                task_inject_tail = NULL;
+            }
+        }
+        spin_unlock(&task_lock);
+        preempt_enable(t);
+        if (task != NULL)
+        {
+            return task;
+        }
+    }
+
+    // start somewhere different each time, so thieves spread out
+    n = __atomic_load_n(&task_pool_size, __ATOMIC_ACQUIRE);
+    start = n > 0 ? (int)(trace_clock() % n) : 0;
+    for (i = 0; i < n; i++)
+    {
+        task_deque_t *d = __atomic_load_n(&task_deques[(start + i) % n], __ATOMIC_ACQUIRE);
+        if (d != NULL && (self == NULL || d != self->tasks) && (task = td_steal(d)) != NULL)
+        {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+/* some task is queued somewhere */
+static int task_available()
+{
+    int n = __atomic_load_n(&task_pool_size, __ATOMIC_ACQUIRE), i;
+
+    if (__atomic_load_n(&task_inject_head, __ATOMIC_RELAXED) != NULL)
+    {
+        return 1;
+    }
+    for (i = 0; i < n; i++)
+    {
+        task_deque_t *d = __atomic_load_n(&task_deques[i], __ATOMIC_ACQUIRE);
+        if (d != NULL && atomic_load_explicit(&d->bottom, memory_order_acquire) >
+                             atomic_load_explicit(&d->top, memory_order_acquire))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Start another task pool worker, unless enough are running by now.
+ * Pool workers are detached and live as long as the program. */
+static void task_grow()
+{
+    task_deque_t *d;
+    pthread_attr_t attr;
+    worker_t thread;
+    int i;
+
+    d = (task_deque_t *)worker_malloc(sizeof(task_deque_t));
+    if (d == NULL)
+    {
+        return; // the workers we have will get to it
+    }
+    memset(d, 0, sizeof(task_deque_t));
+    spin_lock(&task_lock);
+    i = task_pool_size;
+    if (i >= TASK_POOL_MAX || i - __atomic_load_n(&task_pool_blocked, __ATOMIC_RELAXED) >= num_carriers)
+    {
+        spin_unlock(&task_lock);
+        worker_free(d);
+        return;
+    }
+    __atomic_store_n(&task_deques[i], d, __ATOMIC_RELEASE);
+    __atomic_store_n(&task_pool_size, i + 1, __ATOMIC_RELEASE);
+    spin_unlock(&task_lock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (worker_create(&thread, &attr, &task_pool_main, d) != 0)
+    {
+        // nobody pushes on its deque, so it just stays empty
+        fprintf(stderr, "worker: could not start task pool worker %d\n", i);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/* A task pool worker: run tasks until there are none, then park on
+ * task_idle until task_spawn() has more */
+static void *task_pool_main(void *arg)
+{
+    tcb *self = current_tcb();
+    task_t *task;
+
+    self->tasks = (task_deque_t *)arg;
+    for (;;)
+    {
+        if ((task = task_find(self, 1)) != NULL)
+        {
+            task_run(self, task);
+            continue;
+        }
+
+        preempt_disable();
+        spin_lock(&task_lock);
+        __atomic_add_fetch(&task_pool_idle, 1, __ATOMIC_SEQ_CST);
+        if (task_available())
+        {
+            task_pool_idle--;
+            spin_unlock(&task_lock);
+            preempt_enable(self);
+            continue;
+        }
+        self->next = task_idle;
+        task_idle = self;
+        park(self, &task_lock);
+        preempt_enable(self);
+    }
+    return NULL;
+}
+
+/* Run the worker_parallel_for() piece arg: split off its upper half as a
+ * task, work on the lower half, then wait for the upper one. The halves
+ * live on this stack until both are done. */
+static void for_run(void *arg)
+{
+    for_range_t *range = (for_range_t *)arg;
+    for_range_t lower, upper;
+    worker_task_group_t group;
+
+    if (range->end - range->begin <= range->grain)
+    {
+        range->function(range->begin, range->end, range->arg);
+        return;
+    }
+    lower = upper = *range;
+    lower.end = upper.begin = range->begin + (range->end - range->begin) / 2;
+    memset(&group, 0, sizeof(group));
+    upper.task.function = &for_run;
+    upper.task.arg = &upper;
+    upper.task.heap = 0;
+    task_spawn(&upper.task, &group);
+    for_run(&lower);
+    // most of the time nobody stole it, and we run it ourselves
+    task_wait(&group);
+}
+
+/* Owner side: push at bottom. Returns -1 when full. */
+static int td_push(task_deque_t *d, task_t *task)
+{
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&d->top, memory_order_acquire);
+
+    if (b - top >= TASK_CAPACITY)
+    {
+        return -1;
+    }
+    __atomic_store_n(&d->slots[b & (TASK_CAPACITY - 1)], task, __ATOMIC_RELAXED);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+    return 0;
+}
+
+/* Owner side: take the newest task back from bottom. Only the last one
+ * left is raced for with thieves. */
+static task_t *td_pop(task_deque_t *d)
+{
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    long top;
+    task_t *task;
+
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    top = atomic_load_explicit(&d->top, memory_order_relaxed);
+    if (top > b)
+    {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return NULL; // empty
+    }
+    task = __atomic_load_n(&d->slots[b & (TASK_CAPACITY - 1)], __ATOMIC_RELAXED);
+    if (top == b)
+    {
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed))
+        {
+            task = NULL; // a thief got it
+        }
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+/* Thief side: take the oldest task from top */
+static task_t *td_steal(task_deque_t *d)
+{
+    long top = atomic_load_explicit(&d->top, memory_order_acquire);
+    long b;
+    task_t *task;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (top >= b)
+    {
+        return NULL;
+    }
+    task = __atomic_load_n(&d->slots[top & (TASK_CAPACITY - 1)], __ATOMIC_RELAXED);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed))
+    {
+        return NULL; // lost to the owner or another thief
+    }
+    return task;
+}
+
+/* Do the first of cases that can go through, starting at a random one.
+ * If none can and block is set, queue a waiter for each case and park
+ * until another thread lets one through. The channels stay locked, in
+ * address order, from the first look until we are queued on all of them,
+ * so no case can go through behind our back in between. */
+static int chan_select(worker_chan_case_t *cases, int ncases, int *chosen, int block)
+{
+    worker_chan_t *order[WORKER_CHAN_SELECT_MAX];
+    chan_waiter_t node[WORKER_CHAN_SELECT_MAX];
+    chan_wait_t wait, *woken;
+    worker_chan_case_t *c;
+    tcb *self, *t;
+    int nlocked, start, i, k, ret;
+
+    if (ncases < 1 || ncases > WORKER_CHAN_SELECT_MAX)
+    {
+        return EINVAL;
+    }
+    self = preempt_disable();
+    nlocked = chan_lock_all(cases, ncases, order);
+    if (nlocked == 0)
+    {
+        preempt_enable(self);
+        return EINVAL; // nothing to wait for, ever
+    }
+
+    start = ncases > 1 ? (int)(trace_clock() % ncases) : 0;
+    for (k = 0; k < ncases; k++)
+    {
+        i = (start + k) % ncases;
+        if (cases[i].chan == NULL || (ret = chan_try(&cases[i], &woken)) < 0)
+        {
+            continue;
+        }
+        chan_unlock_all(order, nlocked);
+        *chosen = i;
+        if (woken != NULL && (t = chan_wake(woken)) != NULL)
+        {
+            // Unbuffered, a value handed to a parked receiver: run it
+            // right away, on this CPU. A buffered sender would rather go
+            // on filling the buffer while the receiver waits its turn.
+            if (self != NULL && cases[i].op == WORKER_CHAN_SEND && cases[i].chan->capacity == 0)
+            {
+                wake_switch(self, t);
+            }
+            else
+            {
+                wake(t);
+            }
+        }
+        preempt_enable(self);
+        return ret;
+    }
+    if (!block)
+    {
+        chan_unlock_all(order, nlocked);
+        preempt_enable(self);
+        return EAGAIN;
+    }
+
+    wait.t = self;
+    atomic_flag_clear(&wait.lock);
+    wait.fired = 0;
+    wait.status = 0;
+    wait.woken = 0;
+    for (i = 0; i < ncases; i++)
+    {
+        if ((c = &cases[i])->chan == NULL)
+        {
+            continue;
+        }
+        node[i].wait = &wait;
+        node[i].elem = c->elem;
+        node[i].index = i;
+        if (c->op == WORKER_CHAN_SEND)
+        {
+            chan_append(&c->chan->send_head, &c->chan->send_tail, &node[i]);
+        }
+        else
+        {
+            chan_append(&c->chan->recv_head, &c->chan->recv_tail, &node[i]);
+        }
+    }
+    if (self != NULL)
+    {
+        // taken before the channels are let go, so whoever fires us first
+        // waits in chan_wake() until we are off the CPU
+        spin_lock(&wait.lock);
+        chan_unlock_all(order, nlocked);
+        park(self, &wait.lock);
+    }
+    else
+    {
+        chan_unlock_all(order, nlocked);
+        while (!__atomic_load_n(&wait.woken, __ATOMIC_ACQUIRE))
+        {
+            sched_yield();
+        }
+    }
+
+    // one case went through; take the others back off their channels
+    chan_lock_all(cases, ncases, order);
+    for (i = 0; i < ncases; i++)
+    {
+        if ((c = &cases[i])->chan != NULL && node[i].queued)
+        {
+            if (c->op == WORKER_CHAN_SEND)
+            {
+                chan_unlink(&c->chan->send_head, &c->chan->send_tail, &node[i]);
+            }
+            else
+            {
+                chan_unlink(&c->chan->recv_head, &c->chan->recv_tail, &node[i]);
+            }
+        }
+    }
+    chan_unlock_all(order, nlocked);
+    *chosen = wait.fired - 1;
+    preempt_enable(self);
+    return wait.status;
+}
+
+/* Let c through on its channel, which is locked, if it can go without
+ * waiting. Returns -1 if it can't, else 0, or EPIPE if the channel is
+ * closed. *woken is the parked select this let through as well, if any. */
+static int chan_try(worker_chan_case_t *c, chan_wait_t **woken)
+{
+    worker_chan_t *chan = c->chan;
+    size_t size = chan->elem_size;
+    chan_waiter_t *w;
+
+    *woken = NULL;
+    if (c->op == WORKER_CHAN_SEND)
+    {
+        if (chan->closed)
+        {
+            return EPIPE;
+        }
+        if ((w = chan_claim(&chan->recv_head, &chan->recv_tail)) != NULL)
+        {
+            // straight to a waiting receiver, which means the buffer is empty
+            if (w->elem != NULL)
+            {
+                memcpy(w->elem, c->elem, size);
+            }
+            *woken = w->wait;
+            return 0;
+        }
+        if (chan->count < chan->capacity)
+        {
+            memcpy(chan->buf + (size_t)((chan->head + chan->count) % chan->capacity) * size, c->elem, size);
+            chan->count++;
+            return 0;
+        }
+        return -1;
+    }
+
+    if (chan->count > 0)
+    {
+        if (c->elem != NULL)
+        {
+            memcpy(c->elem, chan->buf + (size_t)chan->head * size, size);
+        }
+        chan->head = (chan->head + 1) % chan->capacity;
+        chan->count--;
+        // a sender waiting for room gets the slot we just freed
+        if ((w = chan_claim(&chan->send_head, &chan->send_tail)) != NULL)
+        {
+            memcpy(chan->buf + (size_t)((chan->head + chan->count) % chan->capacity) * size, w->elem, size);
+            chan->count++;
+            *woken = w->wait;
+        }
+        return 0;
+    }
+    if ((w = chan_claim(&chan->send_head, &chan->send_tail)) != NULL)
+    {
+        // unbuffered: take it straight from the sender
+        if (c->elem != NULL)
+        {
+            memcpy(c->elem, w->elem, size);
+        }
+        *woken = w->wait;
+        return 0;
+    }
+    if (chan->closed)
+    {
+        if (c->elem != NULL)
+        {
+            memset(c->elem, 0, size);
+        }
+        return EPIPE;
+    }
+    return -1;
+}
+
+/* Take the first waiter off a channel queue whose select we get to fire.
+ * Waiters whose select another channel fired first are dropped on the way. */
+static chan_waiter_t *chan_claim(chan_waiter_t **head, chan_waiter_t **tail)
+{
+    chan_waiter_t *w;
+    int none;
+
+    while ((w = *head) != NULL)
+    {
+        chan_unlink(head, tail, w);
+        none = 0;
+        if (__atomic_compare_exchange_n(&w->wait->fired, &none, w->index + 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            return w;
+        }
+    }
+    return NULL;
+}
+
+static void chan_append(chan_waiter_t **head, chan_waiter_t **tail, chan_waiter_t *w)
+{
+    w->next = NULL;
+    w->prev = *tail;
+    if (*tail == NULL)
+    {
+        *head = w;
+    }
+    else
+    {
+        (*tail)->next = w;
+    }
+    *tail = w;
+    w->queued = 1;
+}
+
+static void chan_unlink(chan_waiter_t **head, chan_waiter_t **tail, chan_waiter_t *w)
+{
+    if (w->prev == NULL)
+    {
+        *head = w->next;
+    }
+    else
+    {
+        w->prev->next = w->next;
+    }
+    if (w->next == NULL)
+    {
+        *tail = w->prev;
+    }
+    else
+    {
+        w->next->prev = w->prev;
+    }
+    w->queued = 0;
+}
+
+/* Lock the channels of cases in address order, each once, so two selects
+ * on the same channels can't deadlock. order gets them; returns how many. */
+static int chan_lock_all(worker_chan_case_t *cases, int ncases, worker_chan_t **order)
+{
+    worker_chan_t *chan;
+    int n = 0, i, k;
+
+    for (i = 0; i < ncases; i++)
+    {
+        if ((chan = cases[i].chan) == NULL)
+        {
+            continue;
+        }
+        // insertion sort, dropping repeats: there are only a few
+        for (k = n; k > 0 && order[k - 1] > chan; k--)
+        {
+        }
+        if (k > 0 && order[k - 1] == chan)
+        {
+            continue;
+        }
+        memmove(&order[k + 1], &order[k], (n - k) * sizeof(worker_chan_t *));
+        order[k] = chan;
+        n++;
+    }
+    for (i = 0; i < n; i++)
+    {
+        spin_lock(&order[i]->lock);
+    }
+    return n;
+}
+
+static void chan_unlock_all(worker_chan_t **order, int n)
+{
+    while (n-- > 0)
+    {
+        spin_unlock(&order[n]->lock);
+    }
+}
+
+/* Done with the select wait, which a channel fired: returns its thread
+ * for the caller to wake, once it is off the CPU, or NULL if it isn't a
+ * worker. The select may return as soon as this does. */
+static tcb *chan_wake(chan_wait_t *wait)
+{
+    tcb *t = wait->t;
+
+    if (t == NULL)
+    {
+        __atomic_store_n(&wait->woken, 1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+    spin_lock(&wait->lock);
+    spin_unlock(&wait->lock);
+    return t;
+}
+
+/* Record that t is being created, switched in, switched out, blocked,
+ * woken or is exiting at trace_clock() time now, charging the time since
+ * its last event to what it was doing until then. Called by whoever owns
+ * t at that point: its carrier, or its waker once it has taken it off a
+ * wait queue. */
+static void trace(tcb *t, int event, unsigned long long now)
+{
+    unsigned long long i;
+    trace_record_t *r;
+    carrier_t *c;
+
+    switch (t->trace_state)
+    {
+    case TRACE_SWITCH_IN:
+        t->run_time += now - t->state_since;
+        break;
+    case TRACE_BLOCK:
+        t->blocked_time += now - t->state_since;
+        break;
+    default:
+        t->ready_time += now - t->state_since;
+        break;
+    }
+    t->trace_state = event;
+    t->state_since = now;
+
+    switch (event)
+    {
+    case TRACE_CREATE:
+        t->created_at = now;
+        t->ready_time = 0;
+        break;
+    case TRACE_SWITCH_IN:
+        t->switches++;
+        if (t->first_run_at == 0)
+        {
+            t->first_run_at = now;
+        }
+        break;
+    case TRACE_EXIT:
+        __atomic_add_fetch(&done_threads, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&done_switches, t->switches, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&done_turnaround, now - t->created_at, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&done_response, t->first_run_at - t->created_at, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&done_run, t->run_time, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&done_ready, t->ready_time, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&done_blocked, t->blocked_time, __ATOMIC_RELAXED);
+        break;
+    }
+
+    if (trace_ring == NULL)
+    {
+        return;
+    }
+    // Claim a slot; seq is 0 while it is being filled in, so a reader
+    // can tell a torn record from the one it expects there
+    c = current_carrier();
+    i = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    r = &trace_ring[i & (TRACE_EVENTS - 1)];
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    r->tsc = now;
+    r->thread = t->thread_id;
+    r->carrier = c != NULL ? c->carrier_id : -1;
+    r->event = event;
+    __atomic_store_n(&r->seq, i + 1, __ATOMIC_RELEASE);
+}
+
+/* cheap timestamp: the cycle counter where there is one */
+static unsigned long long trace_clock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    unsigned long long ticks;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return now_ns();
+#endif
+}
+
+/* Measure the rate of trace_clock() against the monotonic clock, over
+ * a ms of sleep while the scheduler starts up */
+static void clock_calibrate()
+{
+    struct timespec pause = {0, CALIBRATE_NS};
+    unsigned long long ns, tick;
+
+    clock_base_ns = now_ns();
+    clock_base_tick = trace_clock();
+    while (nanosleep(&pause, &pause) < 0 && errno == EINTR)
+    {
+    }
+    ns = now_ns();
+    tick = trace_clock();
+    ns_per_tick = tick > clock_base_tick ? (double)(ns - clock_base_ns) / (tick - clock_base_tick) : 1;
+}
+
+/* Convert trace_clock() ticks to ns */
+static unsigned long long ticks_to_ns(unsigned long long ticks)
+{
+    return ticks * ns_per_tick;
+}
+
+/* Chrome trace JSON of the ring: a track per carrier with a slice per
+ * run of a worker, and instant events for creation and wakeups */
+static void trace_write(FILE *f)
+{
+    static const char *reason[] = {"create", "run", "yield", "block", "wake", "exit"};
+    unsigned long long head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    unsigned long long i = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+    worker_t open[MAX_CARRIERS + 1] = {0}; // 1 + the worker with a slice open on each track
+    trace_record_t r;
+    double ts = 0;
+    int k, track;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (k = 0; k < num_carriers; k++)
+    {
+        fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                   "\"args\":{\"name\":\"carrier %d\"}},\n", k, k);
+    }
+    fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+               "\"args\":{\"name\":\"other threads\"}}", MAX_CARRIERS);
+
+    for (; i < head && trace_ring != NULL; i++)
+    {
+        trace_record_t *slot = &trace_ring[i & (TRACE_EVENTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != i + 1)
+        {
+            continue;
+        }
+        r = *slot;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != i + 1)
+        {
+            continue; // overwritten while we copied it
+        }
+
+        ts = (r.tsc > clock_base_tick ? ticks_to_ns(r.tsc - clock_base_tick) : 0) / 1000.0;
+        track = r.carrier >= 0 ? r.carrier : MAX_CARRIERS;
+        switch (r.event)
+        {
+        case TRACE_SWITCH_IN:
+            fprintf(f, ",\n{\"name\":\"worker %u\",\"cat\":\"run\",\"ph\":\"B\",\"ts\":%.3f,"
+                       "\"pid\":1,\"tid\":%d}", r.thread, ts, track);
+            open[track] = r.thread + 1;
+            break;
+        case TRACE_SWITCH_OUT:
+        case TRACE_BLOCK:
+        case TRACE_EXIT:
+            // its switch in may have been overwritten already
+            if (open[track] == r.thread + 1)
+            {
+                fprintf(f, ",\n{\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%d,"
+                           "\"args\":{\"left\":\"%s\"}}", ts, track, reason[r.event]);
+                open[track] = 0;
+            }
+            break;
+        default:
+            fprintf(f, ",\n{\"name\":\"%s %u\",\"cat\":\"sched\",\"ph\":\"i\",\"s\":\"t\","
+                       "\"ts\":%.3f,\"pid\":1,\"tid\":%d}", reason[r.event], r.thread, ts, track);
+            break;
+        }
+    }
+
+    // close whatever is still running
+    for (k = 0; k <= MAX_CARRIERS; k++)
+    {
+        if (open[k] != 0)
+        {
+            fprintf(f, ",\n{\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%d}", ts, k);
+        }
+    }
+    fprintf(f, "\n]}\n");
+}
+
+/* WORKER_TRACE: dump the trace when the program ends */
+static void trace_at_exit()
+{
+    if (worker_trace_dump(trace_path) != 0)
+    {
+        perror(trace_path);
+    }
+}
+
+/* queue t on c, which must be the calling carrier, under the active policy */
+static void rq_push(carrier_t *c, tcb *t)
+{
+#ifdef CFS
+    cfs_push(c, t);
+    return;
+#endif
+#ifndef MLFQ
+    rq_t *rq = &c->rq[0];
+#else
+    rq_t *rq = &c->rq[mlfq_level(t)];
+    __atomic_store_n(&t->queued, 1, __ATOMIC_RELAXED);
+#endif
+
+    if (rq_push_bottom(rq, t) < 0)
+    {
+        // deque is full, spill to the shared queue
+        t->queued = 0;
+        inject_push(t);
+    }
+}
+
+/* Owner side: push at bottom without locks. Returns -1 when full. */
+static int rq_push_bottom(rq_t *rq, tcb *t)
+{
+    long b = atomic_load_explicit(&rq->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&rq->top, memory_order_acquire);
+
+    if (b - top >= RQ_CAPACITY)
+    {
+        return -1;
+    }
+    __atomic_store_n(&rq->slots[b & (RQ_CAPACITY - 1)], t, __ATOMIC_RELAXED);
+    atomic_store_explicit(&rq->bottom, b + 1, memory_order_release);
+    return 0;
+}
+
+#ifndef CFS
+/* Owner and thieves: take from top with a CAS. The owner takes FIFO too,
+ * so a thread that just yielded goes behind everything already queued. */
+static tcb *rq_take(rq_t *rq)
+{
+    long top = atomic_load_explicit(&rq->top, memory_order_acquire);
+    long b = atomic_load_explicit(&rq->bottom, memory_order_acquire);
+    tcb *t;
+
+    while (top < b)
+    {
+        t = __atomic_load_n(&rq->slots[top & (RQ_CAPACITY - 1)], __ATOMIC_RELAXED);
+        if (atomic_compare_exchange_weak_explicit(&rq->top, &top, top + 1,
+                                                  memory_order_acq_rel, memory_order_acquire))
+        {
+            return t;
+        }
+        b = atomic_load_explicit(&rq->bottom, memory_order_acquire);
+    }
+    return NULL;
+}
+
+/* The entry for t just taken off a run queue may run it. MLFQ leaves an
+ * entry behind when mutex_lend() moves a queued thread up a level:
+ * whichever of the two is taken first gets it, the other is dropped. */
+static int rq_claim(tcb *t)
+{
+#ifdef MLFQ
+    int one = 1;
+    return __atomic_compare_exchange_n(&t->queued, &one, 0, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+#else
+    return 1;
+#endif
+}
+#endif
+
+static long rq_size(rq_t *rq)
+{
+    long n = atomic_load_explicit(&rq->bottom, memory_order_acquire) -
+             atomic_load_explicit(&rq->top, memory_order_acquire);
+    return n > 0 ? n : 0;
+}
+
+static void inject_push(tcb *t)
+{
+    t->next = NULL;
+    spin_lock(&inject_lock);
+    if (inject_tail == NULL)
+    {
+        inject_head = t;
+    }
+    else
+    {
+        inject_tail->next = t;
+    }
+    inject_tail = t;
+    spin_unlock(&inject_lock);
+}
+
+static tcb *inject_take()
+{
+    tcb *t;
+
+    if (__atomic_load_n(&inject_head, __ATOMIC_RELAXED) == NULL)
+    {
+        return NULL;
+    }
+    spin_lock(&inject_lock);
+    t = inject_head;
+    if (t != NULL)
+    {
+        inject_head = t->next;
+        if (inject_head == NULL)
+        {
+            inject_tail = NULL;
+        }
+    }
+    spin_unlock(&inject_lock);
+    return t;
+}
+
+/* Free the stacks and tcbs of threads that finished on c. Runs on c's own
+ * kernel thread, with preemption off when called from a worker. */
+static void reap_dead(carrier_t *c)
+{
+    tcb *t;
+
+    while ((t = c->dead) != NULL)
+    {
+        c->dead = t->next;
+        if (t->stack != NULL)
+        {
+            stack_free(t->stack, t->stack_size); // the main worker has none
+        }
+        tcb_put(t);
+    }
+}
+
+/* Take a free tcb, growing the table by a chunk when there is none.
+ * It comes back zeroed but for thread_id, already set to its new handle.
+ * NULL once MAX_THREADS are in use. Preemption must be off. */
+static tcb *tcb_alloc()
+{
+    tcb *t = NULL;
+    worker_t handle;
+
+    spin_lock(&tcb_lock);
+    if (tcb_free_list != NULL)
+    {
+        t = tcb_free_list;
+        tcb_free_list = t->next;
+    }
+    else if (tcb_count < MAX_THREADS)
+    {
+        if (tcb_count % TCB_CHUNK == 0)
+        {
+            tcb *chunk = (tcb *)calloc(TCB_CHUNK, sizeof(tcb));
+            if (chunk == NULL)
+            {
+                perror("MallocTCB");
+                exit(1);
+            }
+            __atomic_store_n(&tcb_chunks[tcb_count / TCB_CHUNK], chunk, __ATOMIC_RELEASE);
+        }
+        t = &tcb_chunks[tcb_count / TCB_CHUNK][tcb_count % TCB_CHUNK];
+        t->thread_id = tcb_count; // generation 0
+        __atomic_store_n(&tcb_count, tcb_count + 1, __ATOMIC_RELEASE);
+    }
+    spin_unlock(&tcb_lock);
+
+    if (t != NULL)
+    {
+        handle = t->thread_id;
+        memset(t, 0, sizeof(tcb));
+        __atomic_store_n(&t->thread_id, handle, __ATOMIC_RELEASE);
+    }
+    return t;
+}
+
+/* tcb that handle names, NULL if it never existed or has been recycled */
+static tcb *tcb_lookup(worker_t handle)
+{
+    unsigned int index = handle & TCB_INDEX_MASK;
+    tcb *t;
+
+    if (index >= __atomic_load_n(&tcb_count, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    t = &tcb_chunks[index / TCB_CHUNK][index % TCB_CHUNK];
+    if (__atomic_load_n(&t->thread_id, __ATOMIC_ACQUIRE) != handle)
+    {
+        return NULL;
+    }
+    return t;
+}
+
+/* Drop a reference to t, recycling it with the last one: the thread
+ * itself lets go once reaped, its joiner once it has the return value.
+ * Bumping the generation right away makes every old handle stale.
+ * Preemption must be off. */
+static void tcb_put(tcb *t)
+{
+    if (__atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    {
+        return;
+    }
+    __atomic_store_n(&t->thread_id, t->thread_id + (1u << TCB_INDEX_BITS), __ATOMIC_RELEASE);
+
+    spin_lock(&tcb_lock);
+    t->next = tcb_free_list;
+    tcb_free_list = t;
+    spin_unlock(&tcb_lock);
+}
+
+/* size class that fits size, or -1 if it is too big to pool */
+static int stack_class(size_t size)
+{
+    int i;
+    for (i = 0; i < STACK_CLASSES; i++)
+    {
+        if (size <= stack_class_size[i])
         {
-            temp = temp->next;
+            return i;
         }
-        temp->data->context = create_start_worker_context(&main_context);
-        break;
     }
+    return -1;
 }
 
-void mlfq_enqueue(tcb *thread, int priority)
+/* Hand out a stack of at least size bytes with a PROT_NONE guard page below
+ * it, so an overflow faults right away. Recycled stacks come from the
+ * carrier's own cache, then the shared free list; only a cold pool mmaps.
+ * Stacks are reserved, not committed: a page costs memory once the stack
+ * has grown into it. NULL when out of memory or mappings.
+ * Runs on the calling carrier with preemption off. */
+void *stack_alloc(size_t size)
 {
-    tnode_t *node = (tnode_t *)malloc(sizeof(tnode_t));
-    node->next = NULL;
-    node->data = thread;
+    carrier_t *c = current_carrier();
+    int cls = stack_class(size);
+    void *stack;
 
-    if (mlfq[priority].head == NULL)
+    if (cls >= 0)
     {
-        mlfq[priority].head = node;
-        mlfq[priority].tail = node;
-        mlfq[priority].size = 1;
+        if (c != NULL && c->stack_cache[cls] != NULL)
+        {
+            stack = c->stack_cache[cls];
+            c->stack_cache[cls] = *stack_link(stack, cls);
+            c->stack_cached[cls]--;
+            return stack;
+        }
+        spin_lock(&stack_lock);
+        stack = stack_free_list[cls];
+        if (stack != NULL)
+        {
+            stack_free_list[cls] = *stack_link(stack, cls);
+        }
+        spin_unlock(&stack_lock);
+        if (stack != NULL)
+        {
+            return stack;
+        }
+        return stack_carve(cls);
     }
-    else
+
+    size = (size + GUARD_SIZE - 1) & ~(size_t)(GUARD_SIZE - 1);
+    char *base = mmap(NULL, size + GUARD_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        return NULL;
+    }
+    if (mprotect(base, GUARD_SIZE, PROT_NONE) < 0)
+    {
+        munmap(base, size + GUARD_SIZE);
+        return NULL;
+    }
+    return base + GUARD_SIZE;
+}
+
+/* Map STACK_SLAB stacks of class cls at once, returning one and putting
+ * the rest on the shared free list. Each sits on its own guard page; if
+ * we run out of mappings halfway, the slab ends there. */
+static void *stack_carve(int cls)
+{
+    size_t step = stack_class_size[cls] + GUARD_SIZE;
+    char *base = mmap(NULL, STACK_SLAB * step, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+    void *first = NULL, *last = NULL;
+    int i;
+
+    if (base == MAP_FAILED)
+    {
+        return NULL;
+    }
+    for (i = 0; i < STACK_SLAB; i++)
+    {
+        char *stack = base + i * step + GUARD_SIZE;
+        if (stack_guard && mprotect(stack - GUARD_SIZE, GUARD_SIZE, PROT_NONE) < 0)
+        {
+            munmap(stack - GUARD_SIZE, (STACK_SLAB - i) * step);
+            break;
+        }
+        if (first == NULL)
+        {
+            first = stack;
+        }
+        else
+        {
+            // chain the rest together, first one last
+            *stack_link(stack, cls) = last;
+            last = stack;
+        }
+    }
+
+    if (last != NULL)
+    {
+        spin_lock(&stack_lock);
+        *stack_link(base + step + GUARD_SIZE, cls) = stack_free_list[cls];
+        stack_free_list[cls] = last;
+        spin_unlock(&stack_lock);
+    }
+    return first;
+}
+
+/* Give a stack from stack_alloc back. Free stacks are chained through
+ * their top word, which the next thread on them touches anyway. With
+ * stack_trim one that leaves the carrier's cache gives the rest of its
+ * pages back. */
+void stack_free(void *stack, size_t size)
+{
+    carrier_t *c = current_carrier();
+    int cls = stack_class(size);
+
+    if (cls < 0)
+    {
+        size = (size + GUARD_SIZE - 1) & ~(size_t)(GUARD_SIZE - 1);
+        munmap((char *)stack - GUARD_SIZE, size + GUARD_SIZE);
+        return;
+    }
+    if (c != NULL && c->stack_cached[cls] < STACK_CACHE_MAX)
+    {
+        *stack_link(stack, cls) = c->stack_cache[cls];
+        c->stack_cache[cls] = stack;
+        c->stack_cached[cls]++;
+        return;
+    }
+    if (stack_trim)
+    {
+        madvise(stack, stack_class_size[cls] - GUARD_SIZE, MADV_DONTNEED);
+    }
+    spin_lock(&stack_lock);
+    *stack_link(stack, cls) = stack_free_list[cls];
+    stack_free_list[cls] = stack;
+    spin_unlock(&stack_lock);
+}
+
+/* bytes of t's stack it has used at most, as far as the paint shows */
+static size_t stack_peak(tcb *t)
+{
+    unsigned long long *word = (unsigned long long *)t->stack;
+    unsigned long long *top = (unsigned long long *)((char *)t->stack + t->stack_size);
+
+    while (word < top && *word == STACK_PAINT)
+    {
+        word++;
+    }
+    return (char *)top - (char *)word;
+}
+
+/* where a free stack of class cls keeps the next one */
+static void **stack_link(void *stack, int cls)
+{
+    return (void **)((char *)stack + stack_class_size[cls]) - 1;
+}
+
+/* worker_malloc size class that fits size */
+static int heap_class(size_t size)
+{
+    int cls = 0;
+
+    while (((size_t)HEAP_MIN << cls) < size)
+    {
+        cls++;
+    }
+    return cls;
+}
+
+/* The heap for the caller to allocate from, with preemption off: its
+ * carrier's, or the shared one, which stays locked until heap_leave(). */
+static heap_t *heap_enter()
+{
+    carrier_t *c = current_carrier();
+
+    if (c != NULL)
+    {
+        return &c->heap;
+    }
+    spin_lock(&shared_heap.lock);
+    return &shared_heap;
+}
+
+static void heap_leave(heap_t *heap)
+{
+    if (heap == &shared_heap)
+    {
+        spin_unlock(&shared_heap.lock);
+    }
+}
+
+/* heap has no free object of class cls: take back what other carriers
+ * freed, else carve one off the class's newest slab, else start a slab.
+ * NULL when out of memory. */
+static void *heap_refill(heap_t *heap, int cls)
+{
+    size_t size = (size_t)HEAP_MIN << cls;
+    heap_slab_t *slab;
+    void *p;
+
+    heap_drain(heap);
+    if ((p = heap->free[cls]) != NULL)
+    {
+        heap->free[cls] = *(void **)p;
+        return p;
+    }
+
+    if ((size_t)(heap->carve_end[cls] - heap->carve[cls]) < size)
+    {
+        spin_lock(&heap_lock);
+        if (heap_slab_next == heap_slab_end)
+        {
+            heap_slab_next = (char *)heap_map(HEAP_CHUNK * HEAP_SLAB);
+            heap_slab_end = heap_slab_next != NULL ? heap_slab_next + HEAP_CHUNK * HEAP_SLAB : NULL;
+        }
+        slab = (heap_slab_t *)heap_slab_next;
+        if (slab != NULL)
+        {
+            heap_slab_next += HEAP_SLAB;
+        }
+        spin_unlock(&heap_lock);
+        if (slab == NULL)
+        {
+            return NULL;
+        }
+        slab->heap = heap;
+        slab->cls = cls;
+        heap->carve[cls] = (char *)slab + HEAP_HEADER;
+        heap->carve_end[cls] = (char *)slab + HEAP_SLAB;
+    }
+    p = heap->carve[cls];
+    heap->carve[cls] += size;
+    return p;
+}
+
+/* put the objects other carriers freed back on heap's class lists */
+static void heap_drain(heap_t *heap)
+{
+    void *p, *next;
+    int cls;
+
+    if (__atomic_load_n(&heap->remote, __ATOMIC_RELAXED) == NULL)
+    {
+        return;
+    }
+    for (p = __atomic_exchange_n(&heap->remote, NULL, __ATOMIC_ACQUIRE); p != NULL; p = next)
+    {
+        next = *(void **)p;
+        cls = heap_slab(p)->cls;
+        *(void **)p = heap->free[cls];
+        heap->free[cls] = p;
+    }
+}
+
+/* header of the slab or big mapping ptr is in */
+static heap_slab_t *heap_slab(void *ptr)
+{
+    return (heap_slab_t *)((uintptr_t)ptr & ~(uintptr_t)(HEAP_SLAB - 1));
+}
+
+/* map size bytes aligned to HEAP_SLAB, NULL when out of memory */
+static void *heap_map(size_t size)
+{
+    char *base = mmap(NULL, size + HEAP_SLAB, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    char *aligned;
+
+    if (base == MAP_FAILED)
+    {
+        return NULL;
+    }
+    // trim what sticks out on either side of the aligned block
+    aligned = (char *)(((uintptr_t)base + HEAP_SLAB - 1) & ~(uintptr_t)(HEAP_SLAB - 1));
+    if (aligned > base)
+    {
+        munmap(base, aligned - base);
+    }
+    munmap(aligned + size, base + HEAP_SLAB - aligned);
+    return aligned;
+}
+
+/* worker_malloc too big for a size class: a mapping of its own. It
+ * needs no lock and no deferred preemption. */
+static void *heap_big(size_t size)
+{
+    size_t total = (HEAP_HEADER + size + GUARD_SIZE - 1) & ~(size_t)(GUARD_SIZE - 1);
+    heap_slab_t *slab;
+
+    if (size > SIZE_MAX - HEAP_SLAB - HEAP_HEADER - GUARD_SIZE)
+    {
+        return NULL;
+    }
+    slab = (heap_slab_t *)heap_map(total);
+    if (slab == NULL)
+    {
+        return NULL;
+    }
+    slab->heap = NULL;
+    slab->size = total;
+    return (char *)slab + HEAP_HEADER;
+}
+
+void timer_signal_handler(int signum)
+{
+    carrier_t *c = self_carrier;
+    tcb *t = self_tcb;
+    int saved_errno = errno;
+
+    // one-shot: the deadline that got us here is spent
+    __atomic_store_n(&c->armed_level, 0, __ATOMIC_RELAXED);
+    if (t == NULL)
+    {
+        return; // carrier is inside schedule()
+    }
+#ifdef CFS
+    if (cfs_keep_running(c, t))
+    {
+        arm_slice(c, t); // not far enough ahead yet, look again later
+        errno = saved_errno;
+        return;
+    }
+#endif
+    if (t->preempt_off)
+    {
+        t->preempt_pending = 1;
+        return;
+    }
+
+    // status stays RUNNING, which tells finish_switch the quantum ran out
+    t->preempt_off = 1;
+    switch_from(t);
+    t->preempt_off = 0;
+    errno = saved_errno;
+    return;
+}
+
+/* entry point of carriers 1..num_carriers-1 */
+static void *carrier_main(void *arg)
+{
+    self_carrier = (carrier_t *)arg;
+    schedule();
+    return NULL;
+}
+
+/* Take blocking_lock on a spare kernel thread. A carrier holds it while
+ * it switches away from a worker it hands us, so yield the CPU to it
+ * rather than spin it off. */
+static void spare_lock()
+{
+    while (atomic_flag_test_and_set_explicit(&blocking_lock, memory_order_acquire))
+    {
+        sched_yield();
+    }
+}
+
+/* A spare kernel thread: runs workers that worker_blocking_begin()
+ * handed off, one at a time, and puts each back on the run queues
+ * once worker_blocking_end() switches back here. */
+static void *spare_main(void *arg)
+{
+    unsigned int seq;
+    tcb *t;
+
+    for (;;)
+    {
+        seq = __atomic_load_n(&spare_seq, __ATOMIC_SEQ_CST);
+        spare_lock();
+        t = blocking_head;
+        if (t != NULL)
+        {
+            blocking_head = t->next;
+            if (blocking_head == NULL)
+            {
+                blocking_tail = NULL;
+            }
+        }
+        else
+        {
+            spare_idle++;
+        }
+        spin_unlock(&blocking_lock);
+
+        if (t == NULL)
+        {
+            syscall(SYS_futex, &spare_seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+            spare_lock();
+            spare_idle--;
+            spin_unlock(&blocking_lock);
+            continue;
+        }
+
+        // still BLOCKED as far as the carriers can tell
+        spare_tcb = t;
+        ctx_switch(&spare_context, &t->context);
+        // t is saved again, it may run on a carrier now
+        wake(t);
+    }
+    return NULL;
+}
+
+void init_scheduler()
+{
+    int i;
+    char *env = getenv("WORKER_CARRIERS");
+    char *preempt = getenv("WORKER_PREEMPT");
+    char *guard = getenv("WORKER_STACK_GUARD");
+    char *trim = getenv("WORKER_STACK_TRIM");
+    char *debug = getenv("WORKER_STACK_DEBUG");
+    pthread_attr_t attr;
+
+    // One carrier per online CPU unless WORKER_CARRIERS says otherwise
+    num_carriers = env != NULL ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_carriers < 1)
+        num_carriers = 1;
+    if (num_carriers > MAX_CARRIERS)
+        num_carriers = MAX_CARRIERS;
+
+    for (i = 0; i < num_carriers; i++)
+    {
+        carriers[i].carrier_id = i;
+    }
+
+    wheel_next = now_ns() / WHEEL_TICK;
+    stack_guard = guard == NULL || atoi(guard) != 0;
+    stack_trim = trim != NULL && atoi(trim) != 0;
+    stack_debug = debug != NULL && atoi(debug) != 0;
+    if (pthread_getattr_default_np(&attr) == 0)
+    {
+        pthread_attr_getstacksize(&attr, &default_stack_size);
+        pthread_attr_destroy(&attr);
+    }
+
+    clock_calibrate();
+    trace_path = getenv("WORKER_TRACE");
+    if (trace_path != NULL && *trace_path != '\0')
+    {
+        trace_ring = (trace_record_t *)calloc(TRACE_EVENTS, sizeof(trace_record_t));
+        if (trace_ring == NULL)
+        {
+            perror("trace");
+            exit(1);
+        }
+        atexit(&trace_at_exit);
+    }
+
+    // Parked I/O waits in one epoll set, wake_fd interrupts its poller
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.data.fd = wake_fd;
+    if (epoll_fd < 0 || wake_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) < 0)
+    {
+        perror("epoll");
+        exit(1);
+    }
+
+#ifdef USE_UCONTEXT
+    if (getcontext(&template_context) < 0)
+    {
+        perror("getcontext");
+        exit(1);
+    }
+#endif
+
+    // Cooperative mode never installs a handler or creates a timer, so
+    // no signal can interrupt the program's own system calls
+    cooperative = preempt != NULL && atoi(preempt) == 0;
+    if (!cooperative)
+    {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &timer_signal_handler;
+        // SA_NODEFER: the handler may switch away for good, and the fast
+        // switch does not restore signal masks, so SIGPROF must not stay
+        // blocked. preempt_off already keeps the handler from nesting.
+        sa.sa_flags = SA_RESTART | SA_NODEFER;
+        sigaction(SIGPROF, &sa, NULL);
+    }
+
+    // Carrier 0 is this kernel thread. Its schedule() loop gets its own
+    // stack because the main stack keeps belonging to the main worker.
+    carrier_t *c0 = &carriers[0];
+    void *sched_stack = stack_alloc(SCHED_STACK_SIZE);
+    if (sched_stack == NULL)
+    {
+        perror("mmap stack");
+        exit(1);
+    }
+    ctx_make(&c0->sched_context, sched_stack, SCHED_STACK_SIZE, &schedule);
+
+    // The caller of the first worker_create becomes a worker itself
+    tcb *starttcb = tcb_alloc();
+    starttcb->refs = 2;
+    starttcb->weight = NICE_0_WEIGHT;
+    starttcb->status = THREAD_STATUS_READY;
+    starttcb->preempt_off = 1;
+    trace(starttcb, TRACE_CREATE, trace_clock());
+
+    init_sched_finish = 1;
+    rq_push(c0, starttcb);
+
+    self_carrier = c0;
+    ctx_switch(&starttcb->context, &c0->sched_context);
+    finish_switch(current_carrier());
+
+    // Only start the other carriers now that our context is saved and
+    // running, otherwise one of them could steal it half-written.
+    for (i = 1; i < num_carriers; i++)
     {
-        mlfq[priority].tail->next = node;
-        mlfq[priority].tail = node;
-        mlfq[priority].size++;
+        if (carrier_spawn(&carriers[i].kthread, NULL, &carrier_main, &carriers[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(1);
+        }
     }
+    preempt_enable(starttcb);
+
     return;
 }
 
-tcb *mlfq_dequeue(int priority)
+/* Entry point of every worker, running on the worker's own stack */
+void start_worker()
+{
+    tcb *t = current_tcb();
+
+    // first time on the CPU: requeue whoever switched to us, then take
+    // the preemption it handed us disabled
+    finish_switch(current_carrier());
+    preempt_enable(t);
+    worker_exit(t->function(t->arg));
+}
+
+#ifdef USE_UCONTEXT
+
+/* Prepare ctx to run entry() on stack the first time it is switched to */
+static void ctx_make(worker_ctx_t *ctx, void *stack, size_t size, void (*entry)())
+{
+    // The template was filled by getcontext once; the fpregs pointer must
+    // point into our own copy.
+    memcpy(ctx, &template_context, sizeof(ucontext_t));
+#if defined(__x86_64__)
+    ctx->uc_mcontext.fpregs = &ctx->__fpregs_mem;
+#endif
+    ctx->uc_stack.ss_sp = stack;
+    ctx->uc_stack.ss_size = size;
+    ctx->uc_stack.ss_flags = 0;
+    ctx->uc_link = NULL;
+    makecontext(ctx, entry, 0);
+}
+
+/* Save the running context in from and resume to */
+static void ctx_switch(worker_ctx_t *from, worker_ctx_t *to)
+{
+    if (swapcontext(from, to) < 0)
+    {
+        perror("swapcontext");
+        exit(1);
+    }
+}
+
+#else
+
+/* Fast path switch. Unlike swapcontext it makes no sigprocmask syscall:
+ * it pushes the callee-saved registers and the FP control words on the
+ * current stack, stores the stack pointer in *from_sp, loads to_sp and
+ * pops the same frame off the other stack. A new context gets a frame
+ * whose return address is tw_ctx_start, which calls the entry function. */
+void tw_ctx_switch(void **from_sp, void *to_sp) __attribute__((visibility("hidden")));
+void tw_ctx_start() __attribute__((visibility("hidden")));
+
+#if defined(__x86_64__)
+
+#define CTX_FRAME_WORDS 8 // FP control words, r15, r14, r13, r12, rbx, rbp, return address
+
+__asm__(
+    ".text\n"
+    ".globl tw_ctx_switch\n"
+    ".hidden tw_ctx_switch\n"
+    ".type tw_ctx_switch, @function\n"
+    "tw_ctx_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size tw_ctx_switch, .-tw_ctx_switch\n"
+    "\n"
+    ".globl tw_ctx_start\n"
+    ".hidden tw_ctx_start\n"
+    ".type tw_ctx_start, @function\n"
+    "tw_ctx_start:\n"
+    "    callq *%r12\n"
+    "    ud2\n"
+    ".size tw_ctx_start, .-tw_ctx_start\n");
+
+/* Prepare ctx to run entry() on stack the first time it is switched to */
+static void ctx_make(worker_ctx_t *ctx, void *stack, size_t size, void (*entry)())
+{
+    // after the final ret the stack is 16-byte aligned, as at a call site
+    unsigned long *top = (unsigned long *)(((unsigned long)stack + size) & ~15UL);
+    unsigned long *frame = top - CTX_FRAME_WORDS;
+
+    memset(frame, 0, CTX_FRAME_WORDS * sizeof(unsigned long));
+    frame[0] = 0x1F80 | (0x037FUL << 32);     // default MXCSR and x87 control word
+    frame[4] = (unsigned long)entry;          // r12
+    frame[7] = (unsigned long)&tw_ctx_start;  // return address
+    ctx->sp = frame;
+}
+
+#elif defined(__aarch64__)
+
+#define CTX_FRAME_WORDS 22 // x19-x28, x29, x30, d8-d15, fpcr, padding
+
+__asm__(
+    ".text\n"
+    ".globl tw_ctx_switch\n"
+    ".hidden tw_ctx_switch\n"
+    ".type tw_ctx_switch, %function\n"
+    "tw_ctx_switch:\n"
+    "    sub sp, sp, #176\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mrs x9, fpcr\n"
+    "    str x9, [sp, #160]\n"
+    "    mov x9, sp\n"
+    "    str x9, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    ldr x9, [sp, #160]\n"
+    "    msr fpcr, x9\n"
+    "    add sp, sp, #176\n"
+    "    ret\n"
+    ".size tw_ctx_switch, .-tw_ctx_switch\n"
+    "\n"
+    ".globl tw_ctx_start\n"
+    ".hidden tw_ctx_start\n"
+    ".type tw_ctx_start, %function\n"
+    "tw_ctx_start:\n"
+    "    blr x19\n"
+    "    brk #0\n"
+    ".size tw_ctx_start, .-tw_ctx_start\n");
+
+/* Prepare ctx to run entry() on stack the first time it is switched to */
+static void ctx_make(worker_ctx_t *ctx, void *stack, size_t size, void (*entry)())
 {
-    if (mlfq[priority].head == NULL)
-        return NULL; // queue must be empty
+    unsigned long *top = (unsigned long *)(((unsigned long)stack + size) & ~15UL);
+    unsigned long *frame = top - CTX_FRAME_WORDS;
+
+    memset(frame, 0, CTX_FRAME_WORDS * sizeof(unsigned long));
+    frame[0] = (unsigned long)entry;          // x19
+    frame[11] = (unsigned long)&tw_ctx_start; // x30, where ret goes
+    ctx->sp = frame;
+}
+
+#endif
 
-    tnode_t *temp_node = mlfq[priority].head;
-    tcb *thread = temp_node->data;
+/* Save the running context in from and resume to */
+static void ctx_switch(worker_ctx_t *from, worker_ctx_t *to)
+{
+    tw_ctx_switch(&from->sp, to->sp);
+}
 
-    mlfq[priority].head = mlfq[priority].head->next; // remove beginning node;
-    free(temp_node);
-    return thread;
-}
\ No newline at end of file
+#endif
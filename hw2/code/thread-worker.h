@@ -11,10 +11,12 @@
 
 /* include lib header files that you need here: */
 #include <unistd.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 #include <ucontext.h>
 
@@ -22,7 +24,8 @@
 
 /* Function Declarations: */
 
-/* create a new thread */
+/* create a new thread. attr may give its stack size, its priority and a
+ * detached state; NULL means the defaults. */
 int worker_create(worker_t *thread, pthread_attr_t *attr, void *(*function)(void *), void *arg);
 
 /* give CPU pocession to other user level worker threads voluntarily */
@@ -34,6 +37,12 @@ void worker_exit(void *value_ptr);
 /* wait for thread termination */
 int worker_join(worker_t thread, void **value_ptr);
 
+/* let thread clean up after itself when it exits, without a join */
+int worker_detach(worker_t thread);
+
+/* wait for thread termination for at most timeout_ns, else ETIMEDOUT */
+int worker_join_timeout(worker_t thread, void **value_ptr, unsigned long long timeout_ns);
+
 /* initial the mutex lock */
 int worker_mutex_init(worker_mutex_t *mutex, const pthread_mutexattr_t
 												 *mutexattr);
@@ -41,10 +50,114 @@ int worker_mutex_init(worker_mutex_t *mutex, const pthread_mutexattr_t
 /* aquire the mutex lock */
 int worker_mutex_lock(worker_mutex_t *mutex);
 
+/* aquire the mutex lock, or give up with ETIMEDOUT at abstime (CLOCK_REALTIME) */
+int worker_mutex_timedlock(worker_mutex_t *mutex, const struct timespec *abstime);
+
+/* aquire the mutex lock if it is free, else EBUSY */
+int worker_mutex_trylock(worker_mutex_t *mutex);
+
 /* release the mutex lock */
 int worker_mutex_unlock(worker_mutex_t *mutex);
 
 /* destroy the mutex */
 int worker_mutex_destroy(worker_mutex_t *mutex);
 
+/* read the contention counters of the mutex */
+int worker_mutex_stats(worker_mutex_t *mutex, worker_mutex_stats_t *stats);
+
+/* condition variables: all zero is a valid, initialized one */
+int worker_cond_init(worker_cond_t *cond, const pthread_condattr_t *attr);
+int worker_cond_wait(worker_cond_t *cond, worker_mutex_t *mutex);
+int worker_cond_timedwait(worker_cond_t *cond, worker_mutex_t *mutex,
+						  const struct timespec *abstime);
+int worker_cond_signal(worker_cond_t *cond);
+int worker_cond_broadcast(worker_cond_t *cond);
+int worker_cond_destroy(worker_cond_t *cond);
+
+/* counting semaphores */
+int worker_sem_init(worker_sem_t *sem, unsigned int value);
+int worker_sem_wait(worker_sem_t *sem);
+int worker_sem_trywait(worker_sem_t *sem);
+int worker_sem_post(worker_sem_t *sem);
+int worker_sem_getvalue(worker_sem_t *sem, int *value);
+int worker_sem_destroy(worker_sem_t *sem);
+
+/* barriers: one thread per round gets WORKER_BARRIER_SERIAL_THREAD */
+int worker_barrier_init(worker_barrier_t *barrier, unsigned int count);
+int worker_barrier_wait(worker_barrier_t *barrier);
+int worker_barrier_destroy(worker_barrier_t *barrier);
+
+/* reader-writer locks: all zero is a valid, unlocked one */
+int worker_rwlock_init(worker_rwlock_t *rwlock, const pthread_rwlockattr_t *attr);
+int worker_rwlock_rdlock(worker_rwlock_t *rwlock);
+int worker_rwlock_tryrdlock(worker_rwlock_t *rwlock);
+int worker_rwlock_wrlock(worker_rwlock_t *rwlock);
+int worker_rwlock_trywrlock(worker_rwlock_t *rwlock);
+int worker_rwlock_unlock(worker_rwlock_t *rwlock);
+int worker_rwlock_destroy(worker_rwlock_t *rwlock);
+
+/* Task groups: many small tasks run on a pool of one worker per carrier,
+ * which steal from each other. A task runs on the stack of the worker
+ * that takes it; waiting for a group runs queued tasks meanwhile. */
+int worker_task_group_init(worker_task_group_t *group);
+int worker_task_group_run(worker_task_group_t *group, void (*function)(void *), void *arg);
+int worker_task_group_wait(worker_task_group_t *group);
+int worker_task_group_destroy(worker_task_group_t *group);
+
+/* call function on pieces of [begin, end) of at most grain indexes (< 1:
+ * pick one) in parallel on the task pool, and wait for them all */
+int worker_parallel_for(long begin, long end, long grain,
+						void (*function)(long begin, long end, void *arg), void *arg);
+
+/* Channels: bounded queues of fixed-size values between workers, any
+ * number of senders and receivers. Capacity 0 makes them unbuffered.
+ * Sending to a closed channel, or receiving from a closed and drained
+ * one, gives EPIPE; the try versions give EAGAIN instead of waiting. */
+int worker_chan_init(worker_chan_t *chan, size_t elem_size, unsigned int capacity);
+int worker_chan_send(worker_chan_t *chan, const void *elem);
+int worker_chan_trysend(worker_chan_t *chan, const void *elem);
+int worker_chan_recv(worker_chan_t *chan, void *elem);
+int worker_chan_tryrecv(worker_chan_t *chan, void *elem);
+int worker_chan_close(worker_chan_t *chan);
+int worker_chan_destroy(worker_chan_t *chan);
+
+/* do one of up to WORKER_CHAN_SELECT_MAX sends and receives, whichever can
+ * go first; *chosen says which */
+int worker_chan_select(worker_chan_case_t *cases, int ncases, int *chosen);
+int worker_chan_tryselect(worker_chan_case_t *cases, int ncases, int *chosen);
+
+/* malloc and free that are safe in a worker preempted at any time, with
+ * a lock-free heap per carrier */
+void *worker_malloc(size_t size);
+void worker_free(void *ptr);
+
+/* park the calling worker for ns nanoseconds, in 100us steps */
+int worker_sleep_ns(unsigned long long ns);
+
+/* poll(2) that parks only the calling worker while it waits */
+int worker_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+
+/* read(2), write(2) and accept(2) that park the calling worker instead of
+ * blocking its carrier. They leave fd in non-blocking mode. */
+ssize_t worker_read(int fd, void *buf, size_t count);
+ssize_t worker_write(int fd, const void *buf, size_t count);
+int worker_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+/* Bracket a system call that may block the kernel thread, like fsync(2)
+ * or a read(2) from disk: the calling worker moves to a spare kernel
+ * thread meanwhile, so the others on its carrier keep running. Returns
+ * EAGAIN if there is no spare to move to; the call then blocks the
+ * carrier as usual, and worker_blocking_end() is still fine to call. */
+int worker_blocking_begin();
+int worker_blocking_end();
+
+/* Where thread's time went so far. Valid until it is joined; the
+ * numbers of a running thread may be slightly off. */
+int worker_stats(worker_t thread, worker_stats_t *stats);
+
+/* Write the events recorded since start (WORKER_TRACE=path turns the
+ * recording on) to path as Chrome trace JSON, if path isn't NULL, and
+ * print average turnaround and response time of the finished threads. */
+int worker_trace_dump(const char *path);
+
 #endif
@@ -1,9 +1,34 @@
 #ifndef TW_TYPES_H
 #define TW_TYPES_H
 
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <ucontext.h>
 
-typedef unsigned int worker_t;
+#define NUM_LEVELS 4 // You can adjust the number of priority levels as needed
+#define RQ_CAPACITY 4096 // slots per run queue deque, must be a power of two
+#define STACK_CLASSES 4  // stack pool size classes
+#define TASK_CAPACITY 1024 // slots per task pool deque, must be a power of two
+#define HEAP_CLASSES 10  // worker_malloc size classes, 16 bytes to 8 kB
+
+// Only x86-64 and aarch64 have a hand-written switch, the rest use ucontext
+#if !defined(__x86_64__) && !defined(__aarch64__) && !defined(USE_UCONTEXT)
+#define USE_UCONTEXT
+#endif
+
+typedef unsigned int worker_t; // see tcb_lookup()
+
+#ifdef USE_UCONTEXT
+typedef ucontext_t worker_ctx_t;
+#else
+/* A switched-out context is just its stack pointer: the callee-saved
+ * registers, FP control words and resume address are pushed on its stack. */
+typedef struct WorkerContext {
+    void *sp;
+} worker_ctx_t;
+#endif
 
 typedef enum {
     THREAD_STATUS_READY,
@@ -14,23 +39,223 @@ typedef enum {
 
 typedef struct TCB
 {
-    worker_t thread_id; // unique thread ID
-    worker_t yield_id; // yielding id
+    worker_t thread_id; // handle: tcb table index plus a generation count
     thread_status_t status; // thread status
-    ucontext_t context; // thread context
+    worker_ctx_t context; // thread context
     int priority;           // Priority level of the thread
+    unsigned long long allot_used; // MLFQ: ns run at this level so far
+    unsigned int boost_epoch;      // MLFQ: last priority boost applied to us
+    int lent;                      // MLFQ: level mutex waiters lent us, see mutex_lend()
+    int queued;                    // MLFQ: 1 while a run queue entry may claim us
+    unsigned long long vruntime;   // CFS: ns run, scaled by NICE_0_WEIGHT / weight
+    unsigned int weight;           // CFS: from the priority in pthread_attr_t
+    struct Carrier *cfs_home;      // CFS: carrier whose min_vruntime ours is relative to
+    struct TCB *heap_left;         // CFS: links in a carrier's vruntime heap
+    struct TCB *heap_right;
+    int heap_rank;
+    void *stack;            // stack the worker runs on, from the stack pool
+    size_t stack_size;      // usable size of stack
+    void *(*function)(void *); // entry point and its argument
+    void *arg;
+    volatile sig_atomic_t preempt_off;     // > 0 while the timer must not switch us out
+    volatile sig_atomic_t preempt_pending; // a tick arrived while preempt_off
+    struct TCB *next;       // link in the inject queue, a wait queue or the dead list
+    atomic_flag join_lock;  // guards joiners and the switch to FINISHED
+    struct TCB *joiners;    // parked in worker_join on us, woken by worker_exit
+    int refs;               // recycled when both the reaper and the joiner let go
+    int joined;             // a joiner has claimed us
+    void *retval;           // passed to worker_exit, handed to the joiner
+    int handoff;            // woken already owning what it waited for, see cond_release()
+    int trace_state;        // what the time since state_since is charged to, see trace()
+    unsigned long long state_since; // trace_clock() ticks, as are the times below
+    unsigned long long created_at;
+    unsigned long long first_run_at; // 0 until it first gets the CPU
+    unsigned long long run_time;     // on the CPU
+    unsigned long long ready_time;   // runnable, waiting for a carrier
+    unsigned long long blocked_time; // parked on a wait queue, a timer or I/O
+    unsigned long switches;          // times it got the CPU
+    size_t stack_peak;      // WORKER_STACK_DEBUG: bytes of stack used, measured at exit
+    struct TaskDeque *tasks; // task pool workers: the deque they own, else NULL
+    int in_task;            // tasks running nested on our stack, see park()
 } tcb;
 
-typedef struct ThreadNode {
-    tcb *data;
-    struct ThreadNode *next;
-    int test_var;
-} tnode_t;
+/* A unit of work for the task pool. It runs on the stack of whichever
+ * pool worker takes it, or of a thread waiting for its group. */
+typedef struct WorkerTask {
+    void (*function)(void *);
+    void *arg;
+    struct worker_task_group_t *group; // told when it finishes
+    struct WorkerTask *next;           // link in the task inject queue
+    int heap;                          // malloc'd, freed once it has run
+} task_t;
+
+/* Chase-Lev deque of tasks. Its pool worker pushes and pops at bottom,
+ * newest first; thieves take the oldest from top with a CAS. */
+typedef struct TaskDeque {
+    atomic_long top;
+    atomic_long bottom;
+    task_t *slots[TASK_CAPACITY];
+} task_deque_t;
+
+/* A piece of a worker_parallel_for() range, split in halves until it is
+ * no bigger than grain */
+typedef struct ForRange {
+    task_t task;            // runs the piece when it is split off
+    long begin, end, grain;
+    void (*function)(long begin, long end, void *arg);
+    void *arg;
+} for_range_t;
+
+/* Scheduler events, see trace() */
+typedef enum {
+    TRACE_CREATE,
+    TRACE_SWITCH_IN,
+    TRACE_SWITCH_OUT,       // preempted or yielded, still runnable
+    TRACE_BLOCK,
+    TRACE_WAKE,
+    TRACE_EXIT
+} trace_event_t;
+
+/* One entry of the trace ring */
+typedef struct TraceRecord {
+    unsigned long long seq;  // 1 + its index in the ring once written, see trace()
+    unsigned long long tsc;
+    worker_t thread;
+    short carrier;           // -1 outside the carriers
+    short event;             // trace_event_t
+} trace_record_t;
+
+/* Where a thread's time went, see worker_stats() */
+typedef struct worker_stats_t {
+    unsigned long long run_ns;
+    unsigned long long ready_ns;      // runnable but not running
+    unsigned long long blocked_ns;
+    unsigned long switches;           // times it got the CPU
+    unsigned long long response_ns;   // creation to first run, 0 until then
+    unsigned long long turnaround_ns; // creation to exit, 0 until then
+    size_t stack_peak;                // bytes of stack used at most, 0 unless WORKER_STACK_DEBUG=1
+} worker_stats_t;
+
+typedef enum {
+    TIMER_IDLE,
+    TIMER_PENDING,          // in the wheel
+    TIMER_FIRING            // taken out of the wheel, callback running
+} timer_state_t;
 
-typedef struct Queue {
-    tnode_t *head;
-    tnode_t *tail;
-    int size;
-} q_t;
+/* A timeout in the timer wheel, on the stack of the worker it wakes */
+typedef struct WorkerTimer {
+    struct WorkerTimer *prev;  // links in a wheel slot
+    struct WorkerTimer *next;
+    unsigned long long expires; // wheel tick it is due at
+    int slot;                   // level * slots per level + index, while pending
+    timer_state_t state;
+    int fired;                  // it took t off its wait
+    tcb *t;                     // the parked waiter
+    atomic_flag *lock;          // the lock t parks under
+    void *wait;                 // what t waits on: a mutex, a thread, ...
+    int (*dequeue)(struct WorkerTimer *timer); // take t off wait, 0 if it was gone
+} wtimer_t;
+
+/* One parked worker_poll() call, on the caller's stack */
+typedef struct IoWait {
+    tcb *t;                 // the caller
+    atomic_flag lock;       // held until t is parked, see io_ready()
+    int fired;              // the first fd event to set it wakes t
+    struct IoWait *next;    // io_ready(): waits to wake once the fd is unlocked
+} io_wait_t;
+
+/* A parked worker_poll() call waiting on one of its fds */
+typedef struct IoWaiter {
+    io_wait_t *wait;
+    int fd;
+    unsigned int events;    // EPOLLIN etc., same bits as POLLIN etc.
+    struct IoWaiter *next;  // next waiter on the same fd
+} io_waiter_t;
+
+/* A worker_chan_select() call parked on its channels, on the caller's
+ * stack. The first channel to claim it through fired is the one whose
+ * case goes through. */
+typedef struct ChanWait {
+    tcb *t;                 // the caller, NULL outside a worker: it spins on woken
+    atomic_flag lock;       // held until t is parked, see chan_wake()
+    int fired;              // 1 + index of the case that went through, 0 until then
+    int status;             // 0, or EPIPE when that case's channel was closed
+    int woken;              // its waker is done with it
+} chan_wait_t;
+
+/* One case of a parked worker_chan_select(), queued on its channel */
+typedef struct ChanWaiter {
+    chan_wait_t *wait;
+    struct ChanWaiter *prev; // links in the channel's send or receive queue
+    struct ChanWaiter *next;
+    void *elem;             // send: the value to take, receive: where it goes
+    int index;              // the case's place in the select
+    int queued;             // still on the channel's queue
+} chan_waiter_t;
+
+/* Per-fd state of the shared epoll set */
+typedef struct IoFd {
+    atomic_flag lock;       // guards the fields below
+    io_waiter_t *waiters;
+    unsigned int armed;     // events the one-shot registration waits for, 0 if none
+    int added;              // fd is in the epoll set
+} io_fd_t;
+
+/* worker_malloc objects of one size class come from slabs: HEAP_SLAB
+ * aligned blocks with this header in front, so the slab of an object is
+ * its address rounded down. An allocation too big for a class gets a
+ * mapping of its own that starts with the same header. */
+typedef struct HeapSlab {
+    struct Heap *heap;      // heap whose class lists the objects go back to, NULL if big
+    int cls;                // size class of the objects
+    size_t size;            // big: bytes mapped
+} heap_slab_t;
+
+/* Free worker_malloc objects of each size class. Each carrier has one,
+ * touched only by itself with preemption off; callers outside the
+ * carriers share another under its lock. */
+typedef struct Heap {
+    void *free[HEAP_CLASSES];   // objects chained through their first word
+    char *carve[HEAP_CLASSES];  // rest of the newest slab of each class, not yet handed out
+    char *carve_end[HEAP_CLASSES];
+    void *remote;           // objects freed elsewhere, pushed with a CAS, see heap_drain()
+    atomic_flag lock;       // the shared heap only
+} heap_t;
+
+/* Fixed-capacity Chase-Lev style deque. Only the owning carrier pushes, at
+ * bottom; the owner and thieves take from top with a CAS. */
+typedef struct RunQueue {
+    atomic_long top;
+    atomic_long bottom;
+    tcb *slots[RQ_CAPACITY];
+} rq_t;
+
+/* A carrier is one kernel thread running its own copy of the scheduler
+ * loop over its own run queue. Workers are multiplexed M:N on carriers. */
+typedef struct Carrier
+{
+    int carrier_id;
+    pthread_t kthread;             // kernel thread backing this carrier
+    pid_t tid;                     // kernel tid, target of the preemption timer
+    timer_t timer;                 // per-carrier one-shot preemption deadline
+    worker_ctx_t sched_context;    // where this carrier's schedule() loop runs
+    tcb *current;                  // worker running on this carrier, NULL in schedule()
+    tcb *prev;                     // just switched out, finish_switch() requeues it
+    atomic_flag *prev_lock;        // wait queue lock prev parked under, or NULL
+    rq_t rq[NUM_LEVELS];           // run queues: RR uses rq[0], MLFQ one per level
+    atomic_flag cfs_lock;          // CFS: guards the heap, thieves take from it too
+    tcb *cfs_root;                 // CFS: leftist min-heap of runnable threads by vruntime
+    unsigned long long min_vruntime; // CFS: vruntime of the last thread picked here
+    unsigned long long cfs_queued; // CFS: total weight on the heap, written under cfs_lock
+    unsigned int cfs_running;      // CFS: weight of the thread picked last, 0 when idle
+    unsigned int ticks;            // schedule() rounds, paces inject queue checks
+    unsigned long long clock;      // MLFQ: time of the last switch, sampled once per switch
+    int armed_level;               // 1 + level the pending deadline is for, 0 if none
+    unsigned int boost_epoch;      // MLFQ: last priority boost this carrier applied
+    tcb *dead;                     // finished threads waiting to be freed
+    void *stack_cache[STACK_CLASSES];   // recycled stacks, owner-only
+    int stack_cached[STACK_CLASSES];
+    heap_t heap;                   // worker_malloc objects, owner-only but for heap.remote
+} carrier_t;
 
-#endif
\ No newline at end of file
+#endif